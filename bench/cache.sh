@@ -0,0 +1,25 @@
+#!/bin/bash
+# Times loading a file of N definitions cold, parsing it and writing its
+# FILE.clc cache, and then warm, from that cache. Run from the top of the
+# tree after make; CLISP and N override the binary and the file size.
+set -e
+
+CLISP=${CLISP:-./clisp}
+N=${N:-10000}
+RUNS=${RUNS:-3}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v n="$N" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf "(def {f%d} (fn {x y} {+ (* x %d) (- y (len {%d %d %d}))}))\n", i, i, i, i + 1, i + 2
+}' > "$dir/defs.lsp"
+
+TIMEFORMAT="%3R"
+for run in $(seq "$RUNS"); do
+    rm -f "$dir/defs.lsp.clc"
+    cold=$( { time "$CLISP" "$dir/defs.lsp" > /dev/null; } 2>&1 )
+    warm=$( { time "$CLISP" "$dir/defs.lsp" > /dev/null; } 2>&1 )
+    echo "run $run: $N defs, cold ${cold}s, warm ${warm}s"
+done
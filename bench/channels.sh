@@ -0,0 +1,27 @@
+#!/bin/bash
+# Times the channel benchmarks: pingpong.lsp passes a counter between the
+# main thread and a spawned one over two channels, and fanout.lsp has one
+# feeder, four workers squaring and the main thread summing, 16384 messages
+# each. A run fails if its ok binding is not 0. Run from the top of the tree
+# after make; CLISP overrides the binary.
+set -e
+
+CLISP=${CLISP:-./clisp}
+RUNS=${RUNS:-3}
+
+# Copies are run so their FILE.clc caches are not left in bench/
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+TIMEFORMAT="%3R"
+for name in pingpong fanout; do
+    cp "bench/$name.lsp" "$dir"
+    for run in $(seq "$RUNS"); do
+        t=$( { time "$CLISP" "$dir/$name.lsp" > "$dir/$name.out"; } 2>&1 )
+        if ! grep -qx "ok: 0" "$dir/$name.out"; then
+            echo "$name: wrong result"
+            exit 1
+        fi
+        echo "$name run $run: ${t}s"
+    done
+done
@@ -0,0 +1,17 @@
+(def {shift} (fn {l n} {join l (map (fn {x} {+ x n}) l)}))
+(def {grow} (fn {l} {shift l (len l)}))
+(def {xs} {0})
+(def {per} (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow xs)))))))))))))
+(def {xs} (grow (grow per)))
+(def {work} (chan 256))
+(def {out} (chan 256))
+(def {sq} (fn {x} {* x x}))
+(def {w0} (spawn {map (fn {i} {send out (sq (recv work))}) per}))
+(def {w1} (spawn {map (fn {i} {send out (sq (recv work))}) per}))
+(def {w2} (spawn {map (fn {i} {send out (sq (recv work))}) per}))
+(def {w3} (spawn {map (fn {i} {send out (sq (recv work))}) per}))
+(def {feeder} (spawn {map (fn {x} {send work x}) xs}))
+(def {total} (foldl + 0 (map (fn {i} {recv out}) xs)))
+(def {n} (len xs))
+(def {ok} (- total (/ (* (- n 1) n (- (* 2 n) 1)) 6)))
+(print-env)
@@ -0,0 +1,12 @@
+(def {shift} (fn {l n} {join l (map (fn {x} {+ x n}) l)}))
+(def {grow} (fn {l} {shift l (len l)}))
+(def {xs} {0})
+(def {xs} (grow (grow (grow (grow (grow (grow (grow xs))))))))
+(def {xs} (grow (grow (grow (grow (grow (grow (grow xs))))))))
+(def {ping} (chan))
+(def {pong} (chan))
+(def {p} (spawn {map (fn {i} {send pong (+ 1 (recv ping))}) xs}))
+(def {r} (map (fn {i} {tail (list (send ping i) (recv pong))}) xs))
+(def {ok} (- (foldl + 0 (map (fn {x} {eval (cons + x)}) r)) (/ (* (len xs) (+ (len xs) 1)) 2)))
+(def {done} (len (await p)))
+(print-env)
@@ -1,6 +1,9 @@
 #include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "mpc.h"
 
@@ -23,29 +26,110 @@ void add_history(char* unused) {}
 #include <editline/readline.h>
 #endif
 
-#define LASSERT(args, cond, fmt, ...) \
+// Hot lambdas are compiled to machine code on x86-64 Unix only
+#if defined(__x86_64__) && !defined(_WIN32)
+#define CLISP_JIT
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// pmap runs on a pool of POSIX threads, elsewhere it is a plain map
+#ifndef _WIN32
+#define CLISP_THREADS
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#define LTHREAD __thread
+#define LLOCK(m) pthread_mutex_lock(&(m))
+#define LUNLOCK(m) pthread_mutex_unlock(&(m))
+#else
+#define LTHREAD
+#define LLOCK(m)
+#define LUNLOCK(m)
+#endif
+
+// The sampling profiler times each thread's CPU with a timer of its own,
+// which is Linux only
+#ifdef __linux__
+#define CLISP_SAMPLER
+#include <signal.h>
+#include <sys/syscall.h>
+#endif
+
+// clisp --serve runs an epoll loop, so is Linux only
+#ifdef __linux__
+#define CLISP_SERVER
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+// Code, environments and sites may be shared by threads running pmap
+#define LREF_INC(n) __atomic_add_fetch(&(n), 1, __ATOMIC_RELAXED)
+#define LREF_DEC(n) __atomic_sub_fetch(&(n), 1, __ATOMIC_ACQ_REL)
+
+#define LASSERT(args, cond, error) \
     if (!(cond)) { \
-        lval* err = lval_err(fmt, ##__VA_ARGS__); \
+        lval* err = error; \
         lval_del(args); \
         return err; \
     }
 
-#define LTYPE_ERR(name, got, exp) \
-    "Error: Function '%s' passed incorrect type. Got %s, expected %s.", name, ltype_name(got), ltype_name(exp)
-
-#define LARG_ERR(name, got, exp) \
-    "Error: Function '%s' passed incorrect number of arguments. Got %i, expected %i.", name, got, exp
-
-#define LEMP_ERR(name) \
-    "Error: Function '%s' passed empty list '{}'", name
+#define LTYPE_ERR(name, got, exp) lval_err(LERR_TYPE, name, got, exp)
+#define LARG_ERR(name, got, exp) lval_err(LERR_ARGS, name, got, exp)
+#define LEMP_ERR(name) lval_err(LERR_EMPTY, name, 0, 0)
 
 struct lval;
 struct lenv;
+struct lcode;
+struct lsite;
+struct lfuture;
+struct lchan;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lsite lsite;
+typedef struct lfuture lfuture;
+typedef struct lchan lchan;
 
 // Create an enum for possible lval types
-enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SFUN, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_SFUN, LVAL_SEXPR, LVAL_QEXPR,
+       LVAL_FUTURE, LVAL_CHAN };
+
+// Errors are a code into this table plus the values to format it with,
+// so nothing is formatted or allocated until the error is printed
+enum { LERR_TYPE, LERR_ARGS, LERR_EMPTY, LERR_NUM, LERR_UNBOUND, LERR_DIV_ZERO,
+       LERR_DEF_SYM, LERR_TOO_MANY, LERR_NOT_FUN, LERR_FILE, LERR_IMAGE, LERR_WORKER,
+       LERR_BLOCKED, LERR_SORT, LERR_UNSUPPORTED, LERR_COUNT };
+
+char* lerr_fmt[] = {
+    [LERR_TYPE]     = "Error: Function '%s' passed incorrect type. Got %s, expected %s.",
+    [LERR_ARGS]     = "Error: Function '%s' passed incorrect number of arguments. Got %li, expected %li.",
+    [LERR_EMPTY]    = "Error: Function '%s' passed empty list '{}'",
+    [LERR_NUM]      = "Invalid number.",
+    [LERR_UNBOUND]  = "Unbound symbol '%s'.",
+    [LERR_DIV_ZERO] = "Error: Division by zero.",
+    [LERR_DEF_SYM]  = "Function '%s' cannot define non-symbol.",
+    [LERR_TOO_MANY] = "Function passed too many arguments. Got %li, expected %li.",
+    [LERR_NOT_FUN]  = "First element is not a function.",
+    [LERR_FILE]     = "Error: Could not open file '%s'.",
+    [LERR_IMAGE]    = "Error: '%s' is not a usable image.",
+    [LERR_WORKER]   = "Error: Function '%s' cannot change globals inside pmap or future.",
+    [LERR_BLOCKED]  = "Error: Function '%s' would wait forever.",
+    [LERR_SORT]     = "Error: Cannot sort a profile by '%s'.",
+    [LERR_UNSUPPORTED] = "Error: Function '%s' is not supported on this platform.",
+};
+
+// Whether errors with this code own their name, rather than it being static
+int lerr_owned(int code) {
+    return code == LERR_UNBOUND || code == LERR_FILE || code == LERR_IMAGE
+        || code == LERR_SORT;
+}
 
 char* ltype_name(int t) {
     switch (t) {
@@ -54,131 +138,455 @@ char* ltype_name(int t) {
         case LVAL_NUM: return "Number"; break;
         case LVAL_ERR: return "Error"; break;
         case LVAL_SYM: return "Symbol"; break;
+        case LVAL_STR: return "String"; break;
         case LVAL_SEXPR: return "S-Expression"; break;
         case LVAL_QEXPR: return "Q-Expression"; break;
+        case LVAL_FUTURE: return "Future"; break;
+        case LVAL_CHAN: return "Channel"; break;
         default: return "Unknown"; break;
     }
 }
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
+typedef int(*ljit_fn)(lval**, long*);
 
 struct lval {
     int type;
     long num;
 
-    char* err;
+    int err;
+    char* err_name;
+    long err_args[2];
     char* sym;
+    char* str;
 
     lbuiltin builtin;
+    lcode* code;
     lenv* env;
-    lval* formals;
-    lval* body;
+    int bound;
 
     int count;
     struct lval** cell;
+    lsite* site;
+    int src;
+
+    lfuture* fut;
+    lchan* chan;
+
+    // Holders of this value, more than one only for globals shared with
+    // snapshots for futures
+    int refs;
+};
+
+// The formals and body of a lambda never change once it is made, so every
+// copy and partial application of it shares them
+struct lcode {
+    int refs;
+    lval* formals;
+    lval* body;
+    // When folding changed the body: the body as written, and the name and
+    // builtin of each fold, in turn. The folded body is run while those are
+    // still bound as they were, as last checked at fold_version.
+    lval* source;
+    lval* folds;
+    long fold_version;
+    int fold_stale;
+
+    int calls;
+    int nojit;
+    ljit_fn jit;
+    size_t jit_size;
+    long jit_version;
+
+    ljit_fn native;
+    int src;
 };
 
+// Environments are shared by reference between copies of a closure, and
+// freed when the last of them lets go. Activation frames borrow the names
+// of their first `fixed` slots from the formals of `code`.
 struct lenv {
+    int refs;
     lenv* par;
     int count;
     char** syms;
     lval** vals;
+    int fixed;
+    lcode* code;
+
+    // A root's latest snapshot for futures, and the lsite_version it
+    // was taken at
+    lenv* snap;
+    long snap_version;
+};
+
+// A call site inside a lambda body remembers the global function its head
+// symbol resolved to, good for as long as lsite_version is unchanged. It is
+// shared by every copy of the body that gets evaluated.
+struct lsite {
+    int refs;
+    long version;
+    char* name;
+    lval* fun;
+};
+
+enum { LFUT_QUEUED, LFUT_RUNNING, LFUT_DONE };
+
+// A future is shared by every copy of its handle, and by the scheduler's
+// queue until a thread takes it. Its state and value are guarded by the
+// scheduler lock.
+struct lfuture {
+    int refs;
+    int state;
+    lenv* env;
+    lval* expr;
+    lval* value;
+    lfuture* next;
+};
+
+// A bounded queue of messages that any number of threads send to and
+// receive from. Each slot's sequence number says whose turn it is: a
+// sender may fill slot i at position pos once it equals pos, and a
+// receiver may empty it once it equals pos + 1.
+#define LCHAN_SIZE 64
+#define LCHAN_MAX (1 << 20)
+
+typedef struct {
+    long seq;
+    lval* v;
+} lslot;
+
+struct lchan {
+    int refs;
+    long mask;
+    lslot* slots;
+    char pad0[64];
+    long head;
+    char pad1[64];
+    long tail;
+    char pad2[64];
 };
 
 void lval_print(lval* v);
+void lval_del(lval* v);
 lval* lval_eval(lenv* e, lval* v);
-lenv* lenv_copy(lenv* e);
+lval* lval_apply(lenv* e, lval* v);
+lval* lval_call_n(lenv* e, lval* f, lval** xs, int given);
+lenv* lenv_ref(lenv* e);
 void lenv_del(lenv* e);
+void lcode_del(lcode* c);
+void lsite_del(lsite* s);
+void ljit_free(lcode* c);
+void lfuture_del(lfuture* f);
+void lchan_del(lchan* c);
+lval* lfuture_wait(lfuture* f);
+unsigned long lcache_hash(char* data, size_t len);
+
+// Each thread keeps up to LHEAP_MAX of the lvals it frees on a list of its
+// own, linked through their first word, and allocates from it before going
+// to malloc. Values may be freed by a different thread to the one that
+// allocated them. A thread other than the main one and the pmap pool must
+// call lheap_cleanup before it exits.
+#define LHEAP_MAX 4096
+
+LTHREAD lval* lheap_free = NULL;
+LTHREAD int lheap_count = 0;
+
+// Every lval this thread has allocated, for profiles
+LTHREAD long lheap_allocs = 0;
+
+lval* lval_alloc(void) {
+    lheap_allocs++;
+    lval* v = lheap_free;
+    if (v) {
+        lheap_free = *(lval**)v;
+        lheap_count--;
+    } else {
+        v = malloc(sizeof(lval));
+    }
+    v->refs = 1;
+    return v;
+}
 
+void lval_free(lval* v) {
+    if (lheap_count == LHEAP_MAX) {
+        free(v);
+        return;
+    }
+    *(lval**)v = lheap_free;
+    lheap_free = v;
+    lheap_count++;
+}
+
+void lheap_cleanup(void) {
+    while (lheap_free) {
+        lval* v = lheap_free;
+        lheap_free = *(lval**)v;
+        free(v);
+    }
+    lheap_count = 0;
+}
 
 lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_NUM;
     v->num = x;
     return v;
 }
 
-lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
+lval* lval_err(int code, char* name, long x, long y) {
+    lval* v = lval_alloc();
     v->type = LVAL_ERR;
+    v->err = code;
+    v->err_name = name;
+    v->err_args[0] = x;
+    v->err_args[1] = y;
+    return v;
+}
 
-    va_list va;
-    va_start(va, fmt);
-
-    // Allocate 512 bytes of space
-    v->err = malloc(512);
-
-    vsnprintf(v->err, 511, fmt, va);
-    v->err = realloc(v->err, strlen(v->err) + 1);
-    va_end(va);
-
+lval* lval_err_owned(int code, char* name) {
+    lval* v = lval_err(code, malloc(strlen(name) + 1), 0, 0);
+    strcpy(v->err_name, name);
     return v;
 }
 
+lval* lval_err_unbound(char* sym) {
+    return lval_err_owned(LERR_UNBOUND, sym);
+}
+
 lval* lval_sym(char* sym) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SYM;
     v->sym = malloc(strlen(sym) + 1);
     strcpy(v->sym, sym);
     return v;
 }
 
+lval* lval_str(char* str) {
+    lval* v = lval_alloc();
+    v->type = LVAL_STR;
+    v->str = malloc(strlen(str) + 1);
+    strcpy(v->str, str);
+    return v;
+}
+
 lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_FUN;
     v->builtin = func;
     return v;
 }
 
 lval* lval_sfun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SFUN;
     v->builtin = func;
     return v;
 }
 
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->site = NULL;
+    v->src = 0;
     return v;
 }
 
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_QEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->site = NULL;
+    v->src = 0;
     return v;
 }
 
+// Latencies in microseconds, counted in power of two buckets
+typedef struct {
+    long count;
+    long total;
+    long max;
+    long buckets[32];
+} lstats_t;
+
+void lstats_add(lstats_t* s, long us) {
+    int i = 0;
+    while (i < 31 && (1L << (i + 1)) <= us) { i++; }
+    s->buckets[i]++;
+    s->count++;
+    s->total += us;
+    if (us > s->max) { s->max = us; }
+}
+
+// The pth percentile, interpolated linearly within the bucket holding it
+// and never more than the largest value seen
+long lstats_percentile(lstats_t* s, int p) {
+    long rank = (s->count * p + 99) / 100;
+    long seen = 0;
+    for (int i = 0; i < 32; i++) {
+        if (s->buckets[i] == 0) { continue; }
+        if (seen + s->buckets[i] < rank) {
+            seen += s->buckets[i];
+            continue;
+        }
+        long lo = i ? 1L << i : 0;
+        long hi = 1L << (i + 1);
+        long v = lo + (hi - lo) * (rank - seen) / s->buckets[i];
+        return v < s->max ? v : s->max;
+    }
+    return 0;
+}
+
+// Nanoseconds since some fixed point
+long lnow_ns(void) {
+#ifdef CLISP_THREADS
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+#else
+    return (long)((double)clock() * 1000000000 / CLOCKS_PER_SEC);
+#endif
+}
+
+// Microseconds since some fixed point
+long lnow(void) {
+    return lnow_ns() / 1000;
+}
+
+// Letting go of a big list frees every value in it, which for a large
+// Q-expression holds up whoever dropped it. Lists of LRECLAIM_MIN cells or
+// more are instead queued for a reclaimer thread to free. A value belongs
+// to just one list, so nothing else can reach a dropped one. The time each
+// drop of a big list takes is counted in lreclaim_stats, for gc-stats.
+#define LRECLAIM_MIN 4096
+#define LRECLAIM_QUEUE 64
+
+int lreclaim_enabled = 1;
+lstats_t lreclaim_stats;
+LTHREAD int lreclaim_worker = 0;
+
+#ifdef CLISP_THREADS
+
+pthread_mutex_t lreclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lreclaim_cond = PTHREAD_COND_INITIALIZER;
+
+struct {
+    pthread_t thread;
+    int started;
+    int quit;
+    int count;
+    lval* queue[LRECLAIM_QUEUE];
+} lreclaim;
+
+void* lreclaim_thread(void* arg) {
+    lreclaim_worker = 1;
+    pthread_mutex_lock(&lreclaim_lock);
+    while (1) {
+        while (lreclaim.count == 0 && !lreclaim.quit) {
+            pthread_cond_wait(&lreclaim_cond, &lreclaim_lock);
+        }
+        if (lreclaim.count == 0) { break; }
+        lval* v = lreclaim.queue[--lreclaim.count];
+        pthread_mutex_unlock(&lreclaim_lock);
+        lval_del(v);
+        pthread_mutex_lock(&lreclaim_lock);
+    }
+    pthread_mutex_unlock(&lreclaim_lock);
+    lheap_cleanup();
+    return NULL;
+}
+
+// Queues v for the reclaimer, starting it the first time. Returns 0 if the
+// caller must free v itself, as when the reclaimer is behind.
+int lreclaim_push(lval* v) {
+    if (!lreclaim_enabled) { return 0; }
+    pthread_mutex_lock(&lreclaim_lock);
+    if (!lreclaim.started && !lreclaim.quit) {
+        int ok = pthread_create(&lreclaim.thread, NULL, lreclaim_thread, NULL) == 0;
+        lreclaim.started = ok ? 1 : -1;
+    }
+    int ok = lreclaim.started == 1 && !lreclaim.quit && lreclaim.count < LRECLAIM_QUEUE;
+    if (ok) {
+        lreclaim.queue[lreclaim.count++] = v;
+        pthread_cond_signal(&lreclaim_cond);
+    }
+    pthread_mutex_unlock(&lreclaim_lock);
+    return ok;
+}
+
+// Frees whatever is still queued, then stops the reclaimer
+void lreclaim_cleanup(void) {
+    pthread_mutex_lock(&lreclaim_lock);
+    lreclaim.quit = 1;
+    pthread_cond_signal(&lreclaim_cond);
+    pthread_mutex_unlock(&lreclaim_lock);
+    if (lreclaim.started == 1) { pthread_join(lreclaim.thread, NULL); }
+}
+
+#else
+
+int lreclaim_push(lval* v) { return 0; }
+void lreclaim_cleanup(void) {}
+
+#endif
+
+void lreclaim_pause(long since) {
+    long us = lnow() - since;
+    LLOCK(lreclaim_lock);
+    lstats_add(&lreclaim_stats, us);
+    LUNLOCK(lreclaim_lock);
+}
+
 void lval_del(lval* v) {
+    // A shared value is freed by whichever holder lets go of it last
+    if (__atomic_load_n(&v->refs, __ATOMIC_ACQUIRE) > 1 && LREF_DEC(v->refs) > 0) {
+        return;
+    }
+
     switch (v->type) {
         case LVAL_NUM: break;
 
-        case LVAL_ERR: free(v->err); break;
+        case LVAL_ERR:
+            if (lerr_owned(v->err))
+                free(v->err_name);
+            break;
 
         case LVAL_FUN:
-            if (!v->builtin) {
-                lval_del(v->formals);
-                lval_del(v->body);
-                lenv_del(v->env);
+            if (v->builtin) {
+                free(v->sym);
+            } else {
+                lcode_del(v->code);
+                if (v->env) { lenv_del(v->env); }
             }
             break;
         case LVAL_SFUN:
         case LVAL_SYM: free(v->sym); break;
+        case LVAL_STR: free(v->str); break;
 
         case LVAL_QEXPR:
-        case LVAL_SEXPR:
+        case LVAL_SEXPR: {
+            long since = v->count >= LRECLAIM_MIN && !lreclaim_worker ? lnow() : 0;
+            if (since && lreclaim_push(v)) {
+                lreclaim_pause(since);
+                return;
+            }
             for (int i = 0; i < v->count; i++) {
                 lval_del(v->cell[i]);
             }
             free(v->cell);
+            if (v->site) { lsite_del(v->site); }
+            if (since) { lreclaim_pause(since); }
             break;
+        }
+
+        case LVAL_FUTURE: lfuture_del(v->fut); break;
+        case LVAL_CHAN: lchan_del(v->chan); break;
     }
 
-    free(v);
+    lval_free(v);
 }
 
 lval* lval_add(lval* v, lval* x) {
@@ -188,35 +596,49 @@ lval* lval_add(lval* v, lval* x) {
     return v;
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
+// Constructors called by the parser as each rule is matched
+lval* lval_read_num(const char* text, int n, lval** xs) {
     errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("Invalid number.");
+    long x = strtol(text, NULL, 10);
+    return errno != ERANGE ? lval_num(x) : lval_err(LERR_NUM, NULL, 0, 0);
 }
 
-lval* lval_read(mpc_ast_t* t) {
-    if (strstr(t->tag, "number")) { return lval_read_num(t); }
-    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+lval* lval_read_sym(const char* text, int n, lval** xs) {
+    return lval_sym((char*)text);
+}
 
-    lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-    if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-    if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+lval* lval_read_str(const char* text, int n, lval** xs) {
+    // Cut off the quotes either side
+    size_t len = strlen(text);
+    char* unescaped = malloc(len - 1);
+    memcpy(unescaped, text + 1, len - 2);
+    unescaped[len - 2] = '\0';
+    unescaped = mpcf_unescape(unescaped);
+    lval* x = lval_str(unescaped);
+    free(unescaped);
+    return x;
+}
 
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
+lval* lval_read_sexpr(const char* text, int n, lval** xs) {
+    lval* x = lval_sexpr();
+    for (int i = 0; i < n; i++)
+        x = lval_add(x, xs[i]);
+    return x;
+}
 
-        x = lval_add(x, lval_read(t->children[i]));
-    }
+lval* lval_read_qexpr(const char* text, int n, lval** xs) {
+    lval* x = lval_qexpr();
+    for (int i = 0; i < n; i++)
+        x = lval_add(x, xs[i]);
     return x;
 }
 
+lval* lval_read_expr(const char* text, int n, lval** xs) {
+    return xs[0];
+}
+
 lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
+    lval* x = lval_alloc();
     x->type = v->type;
 
     switch (v->type) {
@@ -225,24 +647,35 @@ lval* lval_copy(lval* v) {
         case LVAL_FUN: 
             if (v->builtin) {
                 x->builtin = v->builtin;
+                x->sym = malloc(strlen(v->sym) + 1);
+                strcpy(x->sym, v->sym);
             } else {
                 x->builtin = NULL;
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
-                x->env = lenv_copy(v->env);
+                x->code = v->code;
+                LREF_INC(x->code->refs);
+                x->env = v->env ? lenv_ref(v->env) : NULL;
+                x->bound = v->bound;
             }
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
             break;
 
         case LVAL_ERR:
-            x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->err, v->err);
+            x->err = v->err;
+            x->err_name = v->err_name;
+            x->err_args[0] = v->err_args[0];
+            x->err_args[1] = v->err_args[1];
+            if (lerr_owned(v->err)) {
+                x->err_name = malloc(strlen(v->err_name) + 1);
+                strcpy(x->err_name, v->err_name);
+            }
             break;
         case LVAL_SYM:
             x->sym = malloc(strlen(v->sym) + 1);
             strcpy(x->sym, v->sym);
             break;
+        case LVAL_STR:
+            x->str = malloc(strlen(v->str) + 1);
+            strcpy(x->str, v->str);
+            break;
 
         case LVAL_QEXPR:
         case LVAL_SEXPR:
@@ -251,49 +684,198 @@ lval* lval_copy(lval* v) {
             for (int i = 0; i < x->count; i++) {
                 x->cell[i] = lval_copy(v->cell[i]);
             }
+            x->site = v->site;
+            x->src = v->src;
+            if (x->site) { LREF_INC(x->site->refs); }
+            break;
+
+        case LVAL_FUTURE:
+            x->fut = v->fut;
+            LREF_INC(x->fut->refs);
+            break;
+        case LVAL_CHAN:
+            x->chan = v->chan;
+            LREF_INC(x->chan->refs);
             break;
     }
 
     return x;
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
+// Values are rendered into a growable buffer and written out in one go,
+// rather than a printf or putchar per atom
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} lbuf;
+
+void lbuf_reserve(lbuf* b, size_t n) {
+    if (b->len + n <= b->cap) { return; }
+    while (b->len + n > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 64;
+    }
+    b->data = realloc(b->data, b->cap);
+}
+
+void lbuf_putc(lbuf* b, char c) {
+    lbuf_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+void lbuf_puts(lbuf* b, char* s) {
+    size_t n = strlen(s);
+    lbuf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+// Digits are produced backwards into a scratch array, no format parsing
+void lbuf_putl(lbuf* b, long x) {
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long u = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    do {
+        digits[--i] = '0' + (u % 10);
+        u /= 10;
+    } while (u);
+    if (x < 0) { digits[--i] = '-'; }
+
+    lbuf_reserve(b, sizeof(digits) - i);
+    memcpy(b->data + b->len, digits + i, sizeof(digits) - i);
+    b->len += sizeof(digits) - i;
+}
+
+void lbuf_printf(lbuf* b, char* fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(NULL, 0, fmt, va);
+    va_end(va);
+
+    lbuf_reserve(b, n + 1);
+    va_start(va, fmt);
+    vsnprintf(b->data + b->len, n + 1, fmt, va);
+    va_end(va);
+    b->len += n;
+}
+
+// Hands back the buffer as a string, leaving the lbuf empty
+char* lbuf_take(lbuf* b) {
+    lbuf_putc(b, '\0');
+    char* s = b->data;
+    b->data = NULL;
+    b->len = b->cap = 0;
+    return s;
+}
+
+// Appends everything left in f
+void lbuf_read(lbuf* b, FILE* f) {
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        lbuf_reserve(b, n);
+        memcpy(b->data + b->len, chunk, n);
+        b->len += n;
+    }
+}
+
+void lbuf_flush(lbuf* b, FILE* f) {
+    fwrite(b->data, 1, b->len, f);
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+void lval_write(lbuf* b, lval* v);
+
+void lval_expr_write(lbuf* b, lval* v, char open, char close) {
+    lbuf_putc(b, open);
     for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
+        lval_write(b, v->cell[i]);
 
         if (i != (v->count - 1)) {
-            putchar(' ');
+            lbuf_putc(b, ' ');
         }
     }
-    putchar(close);
+    lbuf_putc(b, close);
 }
 
-void lval_print(lval* v) {
+void lval_err_write(lbuf* b, lval* v) {
+    char* fmt = lerr_fmt[v->err];
+    switch (v->err) {
+        case LERR_TYPE:
+            lbuf_printf(b, fmt, v->err_name, ltype_name(v->err_args[0]), ltype_name(v->err_args[1]));
+            break;
+        case LERR_TOO_MANY:
+            lbuf_printf(b, fmt, v->err_args[0], v->err_args[1]);
+            break;
+        default:
+            lbuf_printf(b, fmt, v->err_name, v->err_args[0], v->err_args[1]);
+            break;
+    }
+}
+
+void lval_str_write(lbuf* b, lval* v) {
+    char* escaped = malloc(strlen(v->str) + 1);
+    strcpy(escaped, v->str);
+    escaped = mpcf_escape(escaped);
+    lbuf_putc(b, '"');
+    lbuf_puts(b, escaped);
+    lbuf_putc(b, '"');
+    free(escaped);
+}
+
+void lval_write(lbuf* b, lval* v) {
     switch (v->type) {
-        case LVAL_NUM: printf("%li", v->num); break;
-        case LVAL_SYM: printf("%s",  v->sym); break;
+        case LVAL_NUM: lbuf_putl(b, v->num); break;
+        case LVAL_SYM: lbuf_puts(b, v->sym); break;
+        case LVAL_STR: lval_str_write(b, v); break;
         case LVAL_SFUN:
         case LVAL_FUN: 
             if (v->builtin) {
-                printf("<builtin function '%s'>", v->sym);
+                lbuf_puts(b, "<builtin function '");
+                lbuf_puts(b, v->sym);
+                lbuf_puts(b, "'>");
             } else {
-                printf("(fn ");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
+                // Partial applications show only the formals still unbound
+                lval* formals = v->code->formals;
+                lbuf_puts(b, "(fn {");
+                for (int i = v->bound; i < formals->count; i++) {
+                    lval_write(b, formals->cell[i]);
+                    if (i != (formals->count - 1)) {
+                        lbuf_putc(b, ' ');
+                    }
+                }
+                lbuf_puts(b, "} ");
+                lval_write(b, v->code->source ? v->code->source : v->code->body);
+                lbuf_putc(b, ')');
             }
             break;
-        case LVAL_ERR: printf("%s",  v->err); break;
-        case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-        case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+        case LVAL_ERR: lval_err_write(b, v); break;
+        case LVAL_SEXPR: lval_expr_write(b, v, '(', ')'); break;
+        case LVAL_QEXPR: lval_expr_write(b, v, '{', '}'); break;
+        case LVAL_FUTURE: lbuf_puts(b, "<future>"); break;
+        case LVAL_CHAN: lbuf_puts(b, "<channel>"); break;
     }
 }
 
+// Where this thread prints, if not stdout: clisp --batch gives each file
+// its own output
+LTHREAD FILE* lval_out = NULL;
+
+#define lout() (lval_out ? lval_out : stdout)
+
+void lval_print(lval* v) {
+    lbuf b = {0};
+    lval_write(&b, v);
+    lbuf_flush(&b, lout());
+}
+
 void lval_println(lval* v) {
-    lval_print(v);
-    putchar('\n');
+    lbuf b = {0};
+    lval_write(&b, v);
+    lbuf_putc(&b, '\n');
+    lbuf_flush(&b, lout());
 }
 
 lval* lval_pop(lval* v, int i) {
@@ -319,52 +901,200 @@ lval* lval_join(lval* x, lval* y) {
 }
 
 lenv* lenv_new(void) {
-    lenv* env = malloc(sizeof(lenv*));
+    lenv* env = malloc(sizeof(lenv));
+    env->refs = 1;
     env->par = NULL;
     env->count = 0;
     env->syms = NULL;
     env->vals = NULL;
+    env->fixed = 0;
+    env->code = NULL;
+    env->snap = NULL;
+    return env;
+}
+
+// A frame for a call to c: one slot per formal, filled positionally by the
+// caller, which sets count to the number of slots it filled
+lenv* lenv_frame(lcode* c) {
+    int n = c->formals->count;
+    lenv* env = lenv_new();
+    env->syms = malloc(sizeof(char*) * n);
+    env->vals = malloc(sizeof(lval*) * n);
+    for (int i = 0; i < n; i++) {
+        env->syms[i] = c->formals->cell[i]->sym;
+    }
+    env->fixed = n;
+    env->code = c;
+    LREF_INC(c->refs);
     return env;
 }
 
+lenv* lenv_ref(lenv* e) {
+    LREF_INC(e->refs);
+    return e;
+}
+
 void lenv_del(lenv* e) {
+    if (LREF_DEC(e->refs) > 0) { return; }
+
     for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
+        if (i >= e->fixed) { free(e->syms[i]); }
         lval_del(e->vals[i]);
     }
     free(e->syms);
     free(e->vals);
+    if (e->code) { lcode_del(e->code); }
+    if (e->snap) { lenv_del(e->snap); }
     free(e);
 }
 
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv*));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
-    for (int i = 0; i < n->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+// Set on threads running pmap work. These share the global environment
+// read-only, so they neither change globals nor fill call site caches.
+LTHREAD int lpool_worker = 0;
+
+// Set while running a future. Its snapshot shares code with globals that
+// may change meanwhile, so call site caches and the JIT are left alone.
+LTHREAD int lsched_worker = 0;
+
+// Bumped whenever a global binding changes or a name is first bound
+// locally, which invalidates every call site
+long lsite_version = 1;
+
+#define lsite_current() __atomic_load_n(&lsite_version, __ATOMIC_RELAXED)
+#define lsite_invalidate() __atomic_add_fetch(&lsite_version, 1, __ATOMIC_RELAXED)
+
+// Names ever bound by formals or let. With dynamic scope any call may
+// shadow these, so sites calling them are never cached.
+int lsite_nlocals = 0;
+char** lsite_locals = NULL;
+#ifdef CLISP_THREADS
+pthread_mutex_t lsite_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void lsite_local(char* sym) {
+    LLOCK(lsite_lock);
+    for (int i = 0; i < lsite_nlocals; i++) {
+        if (strcmp(lsite_locals[i], sym) == 0) {
+            LUNLOCK(lsite_lock);
+            return;
+        }
     }
+    lsite_nlocals++;
+    lsite_locals = realloc(lsite_locals, sizeof(char*) * lsite_nlocals);
+    lsite_locals[lsite_nlocals - 1] = malloc(strlen(sym) + 1);
+    strcpy(lsite_locals[lsite_nlocals - 1], sym);
+    lsite_invalidate();
+    LUNLOCK(lsite_lock);
+}
 
-    lenv_del(e);
-    return n;
+int lsite_is_local(char* sym) {
+    int found = 0;
+    LLOCK(lsite_lock);
+    for (int i = 0; i < lsite_nlocals && !found; i++) {
+        found = strcmp(lsite_locals[i], sym) == 0;
+    }
+    LUNLOCK(lsite_lock);
+    return found;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0)
-            return lval_copy(e->vals[i]);
+void lsite_cleanup(void) {
+    for (int i = 0; i < lsite_nlocals; i++) {
+        free(lsite_locals[i]);
+    }
+    free(lsite_locals);
+}
+
+void lsite_del(lsite* s) {
+    if (LREF_DEC(s->refs) > 0) { return; }
+    free(s->name);
+    free(s);
+}
+
+// Gives every list in v that looks like a call its own site
+void lsite_attach(lval* v) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+
+    if (!v->site && v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+        v->site = malloc(sizeof(lsite));
+        v->site->refs = 1;
+        v->site->version = 0;
+        v->site->name = malloc(strlen(v->cell[0]->sym) + 1);
+        strcpy(v->site->name, v->cell[0]->sym);
+        v->site->fun = NULL;
+    }
+    for (int i = 0; i < v->count; i++) {
+        lsite_attach(v->cell[i]);
+    }
+}
+
+// The value bound to sym, still owned by the environment, or NULL
+lval* lenv_lookup(lenv* e, char* sym) {
+    for (; e; e = e->par) {
+        for (int i = 0; i < e->count; i++) {
+            if (strcmp(e->syms[i], sym) == 0)
+                return e->vals[i];
+        }
+    }
+    return NULL;
+}
+
+// The body a call to c runs: the folded one while every builtin it folded
+// is still bound under the same name, the body as written from the first
+// time one isn't. Futures always run the body as written, since their
+// snapshot may bind names differently to the globals checked here.
+lval* lcode_body(lenv* e, lcode* c) {
+    if (!c->folds) { return c->body; }
+    if (lsched_worker || __atomic_load_n(&c->fold_stale, __ATOMIC_RELAXED)) {
+        return c->source;
+    }
+    long version = lsite_current();
+    if (__atomic_load_n(&c->fold_version, __ATOMIC_ACQUIRE) == version) { return c->body; }
+
+    while (e->par) { e = e->par; }
+    for (int i = 0; i < c->folds->count; i += 2) {
+        char* sym = c->folds->cell[i]->sym;
+        lval* f = lenv_lookup(e, sym);
+        if (lsite_is_local(sym) || !f || f->type != LVAL_FUN
+            || f->builtin != c->folds->cell[i + 1]->builtin) {
+            __atomic_store_n(&c->fold_stale, 1, __ATOMIC_RELAXED);
+            return c->source;
+        }
     }
-    if (e->par)
-        return lenv_get(e->par, k);
+    __atomic_store_n(&c->fold_version, version, __ATOMIC_RELEASE);
+    return c->body;
+}
 
-    return lval_err("Unbound symbol '%s'.", k->sym);
+lval* lenv_get(lenv* e, lval* k) {
+    lval* v = lenv_lookup(e, k->sym);
+    return v ? lval_copy(v) : lval_err_unbound(k->sym);
+}
+
+// Resolves the function called by the list v, through its site if it has
+// one. The symbol is checked against the site since list builtins can change
+// the head of a copied body.
+lval* lenv_lookup_call(lenv* e, lval* v) {
+    lsite* s = v->site;
+    char* sym = v->cell[0]->sym;
+    long version = lsite_current();
+    if (lsched_worker) { return lenv_lookup(e, sym); }
+    if (s && s->version == version && strcmp(s->name, sym) == 0)
+        return s->fun;
+
+    lval* f = lenv_lookup(e, sym);
+    if (s && f && !lpool_worker && strcmp(s->name, sym) == 0 && !lsite_is_local(sym)) {
+        s->version = version;
+        s->fun = f;
+    }
+    return f;
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
+    if (e->par) {
+        lsite_local(k->sym);
+    } else {
+        lsite_invalidate();
+    }
+
     for (int i = 0; i < e->count; i++) {
         if (strcmp(e->syms[i], k->sym) == 0) {
             lval_del(e->vals[i]);
@@ -382,16 +1112,101 @@ void lenv_put(lenv* e, lval* k, lval* v) {
     e->vals[e->count - 1] = lval_copy(v);
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->builtin = NULL;
-    v->env = lenv_new();
+void lcode_del(lcode* c) {
+    if (LREF_DEC(c->refs) > 0) { return; }
+
+    ljit_free(c);
+    lval_del(c->formals);
+    lval_del(c->body);
+    if (c->source) { lval_del(c->source); }
+    if (c->folds) { lval_del(c->folds); }
+    free(c);
+}
+
+// Takes over the caller's reference to c and env
+lval* lval_closure(lcode* c, lenv* env, int bound) {
+    lval* v = lval_alloc();
     v->type = LVAL_FUN;
-    v->formals = formals;
-    v->body = body;
+    v->builtin = NULL;
+    v->code = c;
+    v->env = env;
+    v->bound = bound;
     return v;
 }
 
+lval* lval_lambda(lval* formals, lval* body) {
+    lsite_attach(body);
+
+    lcode* c = malloc(sizeof(lcode));
+    c->refs = 1;
+    c->formals = formals;
+    c->body = body;
+    c->source = NULL;
+    c->folds = NULL;
+    c->fold_version = 0;
+    c->fold_stale = 0;
+    c->calls = 0;
+    c->nojit = 0;
+    c->jit = NULL;
+    c->jit_size = 0;
+    c->jit_version = 0;
+    c->native = NULL;
+    c->src = 0;
+    return lval_closure(c, NULL, 0);
+}
+
+// A copy of v sharing no code with it. Call sites and compiled code belong
+// to the lcode, so each interpreter running lambdas in its own thread needs
+// lambdas of its own.
+lval* lval_clone(lval* v) {
+    if ((v->type == LVAL_FUN || v->type == LVAL_SFUN) && !v->builtin) {
+        lval* x = lval_lambda(lval_clone(v->code->formals), lval_clone(v->code->body));
+        x->type = v->type;
+        x->code->native = v->code->native;
+        x->code->src = v->code->src;
+        if (v->code->source) {
+            x->code->source = lval_clone(v->code->source);
+            x->code->folds = lval_copy(v->code->folds);
+            x->code->fold_stale = v->code->fold_stale;
+        }
+        if (v->env) {
+            x->env = lenv_frame(x->code);
+            for (int i = 0; i < v->env->count; i++) {
+                x->env->vals[i] = lval_clone(v->env->vals[i]);
+            }
+            x->env->count = v->env->count;
+            x->bound = v->bound;
+        }
+        return x;
+    }
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return lval_copy(v); }
+
+    lval* x = lval_alloc();
+    x->type = v->type;
+    x->count = v->count;
+    x->cell = malloc(sizeof(lval*) * x->count);
+    for (int i = 0; i < x->count; i++) {
+        x->cell[i] = lval_clone(v->cell[i]);
+    }
+    x->site = NULL;
+    x->src = v->src;
+    return x;
+}
+
+// A new root holding a clone of every binding in the root e
+lenv* lenv_clone(lenv* e) {
+    lenv* c = lenv_new();
+    c->count = e->count;
+    c->syms = malloc(sizeof(char*) * e->count);
+    c->vals = malloc(sizeof(lval*) * e->count);
+    for (int i = 0; i < e->count; i++) {
+        c->syms[i] = malloc(strlen(e->syms[i]) + 1);
+        strcpy(c->syms[i], e->syms[i]);
+        c->vals[i] = lval_clone(e->vals[i]);
+    }
+    return c;
+}
+
 void lenv_def(lenv* e, lval* k, lval* v) {
     while (e->par) {
         e = e->par;
@@ -468,19 +1283,19 @@ lval* builtin_len(lenv* e, lval* a) {
     LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
             LTYPE_ERR("len", a->cell[0]->type, LVAL_QEXPR));
 
-    lval* x = lval_num(lval_pop(a, 0)->count);
+    lval* x = lval_num(a->cell[0]->count);
     lval_del(a);
     return x;
 }
 
 lval* builtin_init(lenv* e, lval* a) {
-    LASSERT(a, a->count == 1, LARG_ERR(a->sym, a->count, 1));
+    LASSERT(a, a->count == 1, LARG_ERR("init", a->count, 1));
     LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
             LTYPE_ERR("init", a->cell[0]->type, LVAL_QEXPR));
     
     lval* x = lval_pop(a, 0);
     if (x->count != 0)
-        lval_pop(x, x->count - 1);
+        lval_del(lval_pop(x, x->count - 1));
 
     lval_del(a);
     return x;
@@ -489,7 +1304,7 @@ lval* builtin_init(lenv* e, lval* a) {
 lval* builtin_op(lenv* e, lval* v, char* op) {
     for (int i = 0; i < v->count; i++) {
         if (v->cell[i]->type != LVAL_NUM) {
-            lval* err = lval_err(LTYPE_ERR(op, v->cell[i]->type, LVAL_NUM));
+            lval* err = LTYPE_ERR(op, v->cell[i]->type, LVAL_NUM);
             lval_del(v);
             return err;
         }
@@ -505,8 +1320,12 @@ lval* builtin_op(lenv* e, lval* v, char* op) {
         if (strcmp(op, "*") == 0) { x->num *= y->num; }
         if (strcmp(op, "-") == 0) { x->num -= y->num; }
         if (strcmp(op, "/") == 0) {
-            if (y->num == 0)
-                return lval_err("Error: Division by zero.");
+            if (y->num == 0) {
+                lval_del(x);
+                lval_del(y);
+                lval_del(v);
+                return lval_err(LERR_DIV_ZERO, NULL, 0, 0);
+            }
 
             x->num /= y->num;
         }
@@ -541,9 +1360,11 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
     lval* syms = a->cell[0];
     for (int i = 0; i < syms->count; i++)
         LASSERT(a, syms->cell[i]->type == LVAL_SYM, 
-                "Function '%s' cannot define non-symbol.", func);
+                lval_err(LERR_DEF_SYM, func, 0, 0));
 
     LASSERT(a, syms->count == a->count - 1, LARG_ERR(func, a->count - 1, syms->count));
+    LASSERT(a, !lpool_worker || (strcmp(func, "let") == 0 && e->par),
+            lval_err(LERR_WORKER, func, 0, 0));
 
     for (int i = 0; i < syms->count; i++) {
         if (strcmp(func, "def") == 0) {
@@ -566,215 +1387,3846 @@ lval* builtin_put(lenv* e, lval* a) {
     return builtin_var(e, a, "let");
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    if (f->builtin)
-        return f->builtin(e, a);
+// A baseline JIT for lambdas whose body is arithmetic on their formals and
+// number literals. Once a lambda has been fully applied LJIT_HOT times its
+// body is translated, one fixed template per node, into code for a small
+// stack machine on the native stack. The compiled code checks that every
+// argument is a number and that no divisor is zero, and otherwise returns 0
+// so the call is made again by the interpreter. The operators are resolved
+// when compiling, so the code is rebuilt whenever lsite_version moves on.
+// Setting CLISP_NOJIT in the environment turns it off.
+
+#define LJIT_HOT 100
+#define LJIT_ARGS_MAX 8
+
+int ljit_enabled = 0;
+
+// Applies f to the rest of its arguments through fn, JIT or ahead-of-time
+// compiled. Returns NULL, leaving the arguments alone, when fn bails out to
+// the interpreter.
+lval* lval_call_native(lval* f, lval** xs, int n, ljit_fn fn) {
+    lval* args[f->code->formals->count];
+    for (int i = 0; i < f->bound; i++) {
+        args[i] = f->env->vals[i];
+    }
+    for (int i = 0; i < n; i++) {
+        args[f->bound + i] = xs[i];
+    }
 
-    int given = a->count;
-    int total = f->formals->count;
+    long out;
+    if (!fn(args, &out)) { return NULL; }
 
-    while (a->count) {
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err("Function passed too many arguments. Got %i, expected %i.", given, total);
-        }
+    for (int i = 0; i < n; i++) {
+        lval_del(xs[i]);
+    }
+    return lval_num(out);
+}
 
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_pop(a, 0);
+#ifdef CLISP_JIT
 
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
-    }
+FILE* ljit_perf_map = NULL;
+int ljit_count = 0;
+#ifdef CLISP_THREADS
+pthread_mutex_t ljit_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-    lval_del(a);
+typedef struct {
+    lbuf code;
+    int npatches;
+    int patches[64];
+} ljit_t;
+
+void ljit_bytes(ljit_t* j, char* bytes, int n) {
+    lbuf_reserve(&j->code, n);
+    memcpy(j->code.data + j->code.len, bytes, n);
+    j->code.len += n;
+}
 
-    if (f->formals->count == 0) {
-        f->env->par = e;
+void ljit_imm32(ljit_t* j, int x) { ljit_bytes(j, (char*)&x, 4); }
+void ljit_imm64(ljit_t* j, long x) { ljit_bytes(j, (char*)&x, 8); }
 
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        return lval_copy(f);
+// A jump to the deopt exit, filled in once the exit is placed
+int ljit_deopt_jump(ljit_t* j, char* opcode) {
+    if (j->npatches == sizeof(j->patches) / sizeof(int)) { return 0; }
+    ljit_bytes(j, opcode, 2);
+    j->patches[j->npatches++] = j->code.len;
+    ljit_imm32(j, 0);
+    return 1;
+}
+
+int ljit_formal(lval* formals, char* sym) {
+    for (int i = 0; i < formals->count; i++) {
+        if (strcmp(formals->cell[i]->sym, sym) == 0) { return i; }
     }
+    return -1;
 }
 
-lval* builtin_print_env(lenv* e, lval* a) {
-    LASSERT(a, a->count == 0, LARG_ERR("print-env", a->count, 0));
+// Emits code leaving the value of x pushed, or returns 0 if x is not
+// something this compiler handles
+int ljit_emit(ljit_t* j, lenv* e, lval* formals, lval* x) {
+    if (x->type == LVAL_NUM) {
+        ljit_bytes(j, "\x48\xB8", 2);                     // mov rax, imm64
+        ljit_imm64(j, x->num);
+        ljit_bytes(j, "\x50", 1);                         // push rax
+        return 1;
+    }
 
-    for (int i = 0; i < e->count; i++) {
-        printf("%s: ", e->syms[i]);
-        lval_println(e->vals[i]);
+    if (x->type == LVAL_SYM) {
+        int i = ljit_formal(formals, x->sym);
+        if (i < 0) { return 0; }
+        ljit_bytes(j, "\x48\x8B\x85", 3);                 // mov rax, [rbp - 8(i + 1)]
+        ljit_imm32(j, -8 * (i + 1));
+        ljit_bytes(j, "\x50", 1);                         // push rax
+        return 1;
     }
 
-    lval_del(a);
-    return lval_sexpr();
-}
+    if (x->type != LVAL_SEXPR || x->count == 0) { return 0; }
+    if (x->count == 1) { return ljit_emit(j, e, formals, x->cell[0]); }
 
-lval* builtin_exit(lenv* e, lval* a) {
-    LASSERT(a, a->count == 0, LARG_ERR("exit", a->count, 0));
+    if (x->cell[0]->type != LVAL_SYM || lsite_is_local(x->cell[0]->sym)) { return 0; }
+    lval* f = lenv_lookup(e, x->cell[0]->sym);
+    if (!f || f->type != LVAL_FUN) { return 0; }
+    lbuiltin op = f->builtin;
+    if (op != builtin_add && op != builtin_sub && op != builtin_mul && op != builtin_div) {
+        return 0;
+    }
 
-    exit(0);
-    return lval_sexpr();
+    if (!ljit_emit(j, e, formals, x->cell[1])) { return 0; }
+
+    if (x->count == 2 && op == builtin_sub) {
+        ljit_bytes(j, "\x58\x48\xF7\xD8\x50", 5);         // pop rax; neg rax; push rax
+    }
+
+    for (int i = 2; i < x->count; i++) {
+        if (!ljit_emit(j, e, formals, x->cell[i])) { return 0; }
+        ljit_bytes(j, "\x59\x58", 2);                     // pop rcx; pop rax
+        if (op == builtin_add) { ljit_bytes(j, "\x48\x01\xC8", 3); }      // add rax, rcx
+        if (op == builtin_sub) { ljit_bytes(j, "\x48\x29\xC8", 3); }      // sub rax, rcx
+        if (op == builtin_mul) { ljit_bytes(j, "\x48\x0F\xAF\xC1", 4); }  // imul rax, rcx
+        if (op == builtin_div) {
+            ljit_bytes(j, "\x48\x85\xC9", 3);            // test rcx, rcx
+            if (!ljit_deopt_jump(j, "\x0F\x84")) { return 0; }  // jz deopt
+            ljit_bytes(j, "\x48\x99\x48\xF7\xF9", 5);      // cqo; idiv rcx
+        }
+        ljit_bytes(j, "\x50", 1);                         // push rax
+    }
+    return 1;
+}
+
+void ljit_free(lcode* c) {
+    if (c->jit) { munmap((void*)c->jit, c->jit_size); }
+    c->jit = NULL;
+}
+
+void ljit_compile(lenv* e, lcode* c) {
+    int n = c->formals->count;
+    lval* code = lcode_body(e, c);
+    if (n > LJIT_ARGS_MAX || code->type != LVAL_QEXPR) {
+        ljit_free(c);
+        c->nojit = 1;
+        return;
+    }
+
+    ljit_t j = {{0}};
+
+    // Prologue: check each argument is a number and copy it to a slot
+    ljit_bytes(&j, "\x55\x48\x89\xE5", 4);                // push rbp; mov rbp, rsp
+    ljit_bytes(&j, "\x48\x81\xEC", 3);                   // sub rsp, 8n
+    ljit_imm32(&j, 8 * n);
+    for (int i = 0; i < n; i++) {
+        ljit_bytes(&j, "\x48\x8B\x87", 3);               // mov rax, [rdi + 8i]
+        ljit_imm32(&j, 8 * i);
+        ljit_bytes(&j, "\x83\xB8", 2);                   // cmp dword [rax + type], LVAL_NUM
+        ljit_imm32(&j, offsetof(lval, type));
+        ljit_bytes(&j, (char[]){ LVAL_NUM }, 1);
+        ljit_deopt_jump(&j, "\x0F\x85");                 // jne deopt
+        ljit_bytes(&j, "\x48\x8B\x80", 3);               // mov rax, [rax + num]
+        ljit_imm32(&j, offsetof(lval, num));
+        ljit_bytes(&j, "\x48\x89\x85", 3);               // mov [rbp - 8(i + 1)], rax
+        ljit_imm32(&j, -8 * (i + 1));
+    }
+
+    // The body is compiled as the list it is evaluated as, through a shallow
+    // copy, since other threads may be reading the shared body meanwhile
+    lval body = *code;
+    body.type = LVAL_SEXPR;
+    int ok = ljit_emit(&j, e, c->formals, &body);
+    if (!ok) {
+        free(j.code.data);
+        ljit_free(c);
+        c->nojit = 1;
+        return;
+    }
+
+    // Success: store the result and return 1
+    ljit_bytes(&j, "\x58\x48\x89\x06", 4);                // pop rax; mov [rsi], rax
+    ljit_bytes(&j, "\xB8\x01\x00\x00\x00", 5);            // mov eax, 1
+    ljit_bytes(&j, "\x48\x89\xEC\x5D\xC3", 5);            // mov rsp, rbp; pop rbp; ret
+
+    // Deopt: return 0
+    int deopt = j.code.len;
+    ljit_bytes(&j, "\x31\xC0", 2);                       // xor eax, eax
+    ljit_bytes(&j, "\x48\x89\xEC\x5D\xC3", 5);            // mov rsp, rbp; pop rbp; ret
+    for (int i = 0; i < j.npatches; i++) {
+        int rel = deopt - (j.patches[i] + 4);
+        memcpy(j.code.data + j.patches[i], &rel, 4);
+    }
+
+    // Most global definitions don't touch the operators, so the code
+    // already there is usually still right
+    if (c->jit && c->jit_size == j.code.len && memcmp((void*)c->jit, j.code.data, j.code.len) == 0) {
+        c->jit_version = lsite_current();
+        free(j.code.data);
+        return;
+    }
+    ljit_free(c);
+
+    void* mem = mmap(NULL, j.code.len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(j.code.data);
+        c->nojit = 1;
+        return;
+    }
+    memcpy(mem, j.code.data, j.code.len);
+    mprotect(mem, j.code.len, PROT_READ | PROT_EXEC);
+
+    c->jit = (ljit_fn)mem;
+    c->jit_size = j.code.len;
+    c->jit_version = lsite_current();
+    free(j.code.data);
+
+    // Lets perf put a name to samples in the compiled code
+    LLOCK(ljit_lock);
+    if (!ljit_perf_map) {
+        char name[64];
+        snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+        ljit_perf_map = fopen(name, "w");
+    }
+    if (ljit_perf_map) {
+        fprintf(ljit_perf_map, "%lx %lx clisp_fn_%d\n",
+                (unsigned long)mem, (unsigned long)c->jit_size, ljit_count++);
+        fflush(ljit_perf_map);
+    }
+    LUNLOCK(ljit_lock);
+}
+
+// The result of applying f to all of a through compiled code, or NULL to
+// have the interpreter do it. a is only consumed on success.
+lval* ljit_call(lenv* e, lval* f, lval** xs, int n) {
+    lcode* c = f->code;
+    if (!ljit_enabled || c->nojit || lsched_worker) { return NULL; }
+
+    // pmap workers only run code compiled before they started
+    if (lpool_worker) {
+        if (!c->jit || c->jit_version != lsite_current()) { return NULL; }
+        return lval_call_native(f, xs, n, c->jit);
+    }
+
+    if (!c->jit) {
+        if (++c->calls < LJIT_HOT) { return NULL; }
+        ljit_compile(e, c);
+    } else if (c->jit_version != lsite_current()) {
+        ljit_compile(e, c);
+    }
+    if (!c->jit) { return NULL; }
+
+    return lval_call_native(f, xs, n, c->jit);
+}
+
+void ljit_cleanup(void) {
+    if (ljit_perf_map) { fclose(ljit_perf_map); }
+}
+
+#else
+
+void ljit_free(lcode* c) {}
+lval* ljit_call(lenv* e, lval* f, lval** xs, int n) { return NULL; }
+void ljit_cleanup(void) {}
+
+#endif
+
+// Where the (fn ...) lists in loaded files were read, so profiles can name
+// the lambdas made from them. Lists not read from a file have src 0.
+typedef struct {
+    char* file;
+    int line;
+    int col;
+} lsource_t;
+
+lsource_t* lsources = NULL;
+int lsource_count = 1;
+#ifdef CLISP_THREADS
+pthread_mutex_t lsource_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+int lsource_add(char* file, int line, int col) {
+    LLOCK(lsource_lock);
+    int i = lsource_count++;
+    lsources = realloc(lsources, sizeof(lsource_t) * lsource_count);
+    lsources[i].file = malloc(strlen(file) + 1);
+    strcpy(lsources[i].file, file);
+    lsources[i].line = line;
+    lsources[i].col = col;
+    LUNLOCK(lsource_lock);
+    return i;
+}
+
+void lsource_cleanup(void) {
+    for (int i = 1; i < lsource_count; i++) {
+        free(lsources[i].file);
+    }
+    free(lsources);
+}
+
+// Set while this thread is profiled or sampled, which sends its calls
+// through lhook_call_n
+enum { LHOOK_PROFILE = 1, LHOOK_SAMPLE = 2 };
+
+LTHREAD int lhooks = 0;
+LTHREAD int lhook_direct = 0;
+
+// A profile counts the calls made on the thread that started it, keyed by
+// builtin or by the source of a lambda, timing each in nanoseconds and
+// counting the lvals allocated. Self figures leave out nested calls, and a
+// recursive function's total only counts its outermost call. The JIT is
+// skipped while profiling, so every call is seen.
+typedef struct {
+    lbuiltin builtin;
+    int src;
+    char* name;
+    long calls;
+    long self;
+    long total;
+    long allocs;
+    int active;
+} lprof_entry;
+
+typedef struct {
+    int entry;
+    long start;
+    long children;
+    long allocs;
+    long child_allocs;
+} lprof_frame;
+
+enum { LPROF_SELF, LPROF_TOTAL, LPROF_CALLS, LPROF_ALLOCS, LPROF_COUNT };
+
+char* lprof_keys[] = { "self", "total", "calls", "allocs" };
+
+typedef struct {
+    int on;
+    long generation;
+    int count;
+    lprof_entry* entries;
+    int nslots;
+    int* slots;
+    int depth;
+    int cap;
+    lprof_frame* frames;
+} lprof_t;
+
+LTHREAD lprof_t lprof;
+
+void lprof_free(void) {
+    for (int i = 0; i < lprof.count; i++) {
+        free(lprof.entries[i].name);
+    }
+    free(lprof.entries);
+    free(lprof.slots);
+    free(lprof.frames);
+    long generation = lprof.generation;
+    memset(&lprof, 0, sizeof(lprof));
+    lprof.generation = generation;
+    lhooks &= ~LHOOK_PROFILE;
+}
+
+void lprof_start(void) {
+    lprof_free();
+    lprof.on = 1;
+    lprof.generation++;
+    lhooks |= LHOOK_PROFILE;
+}
+
+unsigned long lprof_hash(lbuiltin builtin, int src) {
+    return builtin ? (unsigned long)builtin >> 4 : (unsigned long)src * 2654435761UL;
+}
+
+// The slot of the entry for f, made on its first call. Slots hold an entry
+// index plus one, and are kept no more than half full.
+int lprof_find(lval* f) {
+    lbuiltin builtin = f->builtin;
+    int src = builtin ? 0 : f->code->src;
+
+    if (lprof.count * 2 >= lprof.nslots) {
+        free(lprof.slots);
+        lprof.nslots = lprof.nslots ? lprof.nslots * 2 : 64;
+        lprof.slots = calloc(lprof.nslots, sizeof(int));
+        for (int i = 0; i < lprof.count; i++) {
+            unsigned long h = lprof_hash(lprof.entries[i].builtin, lprof.entries[i].src);
+            while (lprof.slots[h & (lprof.nslots - 1)]) { h++; }
+            lprof.slots[h & (lprof.nslots - 1)] = i + 1;
+        }
+    }
+
+    unsigned long h = lprof_hash(builtin, src);
+    while (1) {
+        int i = lprof.slots[h & (lprof.nslots - 1)] - 1;
+        if (i < 0) { break; }
+        if (lprof.entries[i].builtin == builtin && lprof.entries[i].src == src) { return i; }
+        h++;
+    }
+
+    lprof.entries = realloc(lprof.entries, sizeof(lprof_entry) * (lprof.count + 1));
+    lprof_entry* x = &lprof.entries[lprof.count];
+    memset(x, 0, sizeof(lprof_entry));
+    x->builtin = builtin;
+    x->src = src;
+    if (builtin) {
+        x->name = malloc(strlen(f->sym) + 1);
+        strcpy(x->name, f->sym);
+    }
+    lprof.slots[h & (lprof.nslots - 1)] = lprof.count + 1;
+    return lprof.count++;
+}
+
+void lprof_enter(lval* f) {
+    if (lprof.depth == lprof.cap) {
+        lprof.cap = lprof.cap ? lprof.cap * 2 : 64;
+        lprof.frames = realloc(lprof.frames, sizeof(lprof_frame) * lprof.cap);
+    }
+    lprof_frame* fr = &lprof.frames[lprof.depth++];
+    fr->entry = lprof_find(f);
+    fr->children = 0;
+    fr->child_allocs = 0;
+    lprof.entries[fr->entry].calls++;
+    lprof.entries[fr->entry].active++;
+    fr->allocs = lheap_allocs;
+    fr->start = lnow_ns();
+}
+
+void lprof_leave(void) {
+    long now = lnow_ns();
+    lprof_frame* fr = &lprof.frames[--lprof.depth];
+    lprof_entry* x = &lprof.entries[fr->entry];
+    long elapsed = now - fr->start;
+    long allocs = lheap_allocs - fr->allocs;
+
+    x->self += elapsed - fr->children;
+    x->allocs += allocs - fr->child_allocs;
+    if (--x->active == 0) { x->total += elapsed; }
+    if (lprof.depth > 0) {
+        lprof.frames[lprof.depth - 1].children += elapsed;
+        lprof.frames[lprof.depth - 1].child_allocs += allocs;
+    }
+}
+
+LTHREAD int lprof_key;
+
+long lprof_value(lprof_entry* x) {
+    switch (lprof_key) {
+        case LPROF_TOTAL: return x->total;
+        case LPROF_CALLS: return x->calls;
+        case LPROF_ALLOCS: return x->allocs;
+        default: return x->self;
+    }
+}
+
+int lprof_cmp(const void* a, const void* b) {
+    long x = lprof_value((lprof_entry*)a);
+    long y = lprof_value((lprof_entry*)b);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Writes the profile out biggest first by key, as a table or as CSV
+void lprof_report(FILE* f, int key, int csv) {
+    LLOCK(lsource_lock);
+    for (int i = 0; i < lprof.count; i++) {
+        lprof_entry* x = &lprof.entries[i];
+        if (x->builtin) { continue; }
+        char* file = x->src ? lsources[x->src].file : "?";
+        x->name = malloc(strlen(file) + 32);
+        if (x->src) {
+            sprintf(x->name, "fn %s:%d:%d", file, lsources[x->src].line, lsources[x->src].col);
+        } else {
+            strcpy(x->name, "fn ?");
+        }
+    }
+    LUNLOCK(lsource_lock);
+
+    lprof_key = key;
+    qsort(lprof.entries, lprof.count, sizeof(lprof_entry), lprof_cmp);
+
+    lbuf b = {0};
+    if (csv) {
+        lbuf_puts(&b, "name,calls,self_us,total_us,allocs\n");
+    } else {
+        lbuf_printf(&b, "%10s %12s %12s %12s  %s\n", "calls", "self-us", "total-us", "allocs", "name");
+    }
+    for (int i = 0; i < lprof.count; i++) {
+        lprof_entry* x = &lprof.entries[i];
+        if (csv) {
+            lbuf_putc(&b, '"');
+            for (char* c = x->name; *c; c++) {
+                if (*c == '"') { lbuf_putc(&b, '"'); }
+                lbuf_putc(&b, *c);
+            }
+            lbuf_printf(&b, "\",%ld,%ld,%ld,%ld\n",
+                        x->calls, x->self / 1000, x->total / 1000, x->allocs);
+        } else {
+            lbuf_printf(&b, "%10ld %12ld %12ld %12ld  %s\n",
+                        x->calls, x->self / 1000, x->total / 1000, x->allocs, x->name);
+        }
+    }
+    lbuf_flush(&b, f);
+}
+
+// Ends the profile, writing it as CSV to the file at csv if given, or as a
+// table to this thread's output
+lval* lprof_stop(int key, char* csv) {
+    FILE* f = csv ? fopen(csv, "w") : lout();
+    if (!f) {
+        lprof_free();
+        return lval_err_owned(LERR_FILE, csv);
+    }
+    lprof_report(f, key, csv != NULL);
+    if (csv) { fclose(f); }
+    lprof_free();
+    return lval_sexpr();
+}
+
+// Reports the CLISP_PROFILE profile, if there is one, at exit
+void lprof_exit(char* profile) {
+    if (!profile || !lprof.on) {
+        lprof_free();
+        return;
+    }
+    lval* x = lprof_stop(LPROF_SELF, strcmp(profile, "-") == 0 ? NULL : profile);
+    if (x->type == LVAL_ERR)
+        lval_println(x);
+    lval_del(x);
+}
+
+// The sampling profiler. While it runs, calls on the thread that started
+// it push what they call onto a shadow stack, and a SIGPROF timer on that
+// thread's CPU time copies the stack into a buffer on each tick. Frames are
+// a builtin's function pointer, or minus one less than a lambda's source,
+// so a tick never allocates or looks anything up. Ticks once the buffer is
+// full are dropped. Compiled code calling itself isn't seen.
+#define LSAMPLE_WORDS (1 << 21)
+#define LSAMPLE_HZ 1000
+
+typedef struct {
+    volatile int on;
+    long generation;
+    long* volatile stack;
+    volatile int depth;
+    int cap;
+    long* buf;
+    volatile long used;
+    volatile long dropped;
+} lsample_t;
+
+LTHREAD lsample_t lsample;
+
+#ifdef CLISP_SAMPLER
+LTHREAD timer_t lsample_timer;
+#endif
+
+void lsample_push(lval* f) {
+    if (lsample.depth == lsample.cap) {
+        int cap = lsample.cap ? lsample.cap * 2 : 256;
+        long* stack = malloc(sizeof(long) * cap);
+        long* old = lsample.stack;
+        if (old) { memcpy(stack, old, sizeof(long) * lsample.depth); }
+        lsample.stack = stack;
+        lsample.cap = cap;
+        free(old);
+    }
+    lsample.stack[lsample.depth] = f->builtin ? (long)f->builtin : -(long)f->code->src - 1;
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    lsample.depth++;
+}
+
+void lsample_pop(void) {
+    lsample.depth--;
+}
+
+// Each sample is its depth followed by its frames, outermost first
+void lsample_tick(int sig) {
+    if (!lsample.on) { return; }
+    int depth = lsample.depth;
+    if (lsample.used + depth + 1 > LSAMPLE_WORDS) {
+        lsample.dropped++;
+        return;
+    }
+    long* s = lsample.buf + lsample.used;
+    s[0] = depth;
+    for (int i = 0; i < depth; i++) {
+        s[i + 1] = lsample.stack[i];
+    }
+    lsample.used += depth + 1;
+}
+
+void lsample_disarm(void) {
+#ifdef CLISP_SAMPLER
+    if (lsample.on) { timer_delete(lsample_timer); }
+#endif
+    lsample.on = 0;
+}
+
+// Stops the timer and throws away the samples
+void lsample_free(void) {
+    lsample_disarm();
+    free(lsample.stack);
+    free(lsample.buf);
+    long generation = lsample.generation;
+    memset(&lsample, 0, sizeof(lsample));
+    lsample.generation = generation;
+    lhooks &= ~LHOOK_SAMPLE;
+}
+
+#ifdef CLISP_SAMPLER
+
+// Samples this thread hz times a second of its CPU time. Returns 0 if the
+// timer couldn't be made.
+int lsample_start(int hz) {
+    lsample_free();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lsample_tick;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct sigevent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo = SIGPROF;
+    ev._sigev_un._tid = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &ev, &lsample_timer) != 0) { return 0; }
+
+    lsample.buf = malloc(sizeof(long) * LSAMPLE_WORDS);
+    lsample.generation++;
+    lsample.on = 1;
+    lhooks |= LHOOK_SAMPLE;
+
+    struct itimerspec t;
+    t.it_interval.tv_sec = 0;
+    t.it_interval.tv_nsec = 1000000000L / hz;
+    t.it_value = t.it_interval;
+    timer_settime(lsample_timer, 0, &t, NULL);
+    return 1;
+}
+
+#else
+
+int lsample_start(int hz) { return 0; }
+
+#endif
+
+// The profile and sampler running when a call began, if any
+typedef struct {
+    long profile;
+    long sample;
+} lhook_t;
+
+void lhook_enter(lhook_t* h, lval* f) {
+    h->profile = lprof.on ? lprof.generation : -1;
+    h->sample = lsample.on ? lsample.generation : -1;
+    if (h->profile >= 0) { lprof_enter(f); }
+    if (h->sample >= 0) { lsample_push(f); }
+}
+
+// The call may have ended either, or started a new one
+void lhook_leave(lhook_t* h) {
+    if (h->sample >= 0 && lsample.on && lsample.generation == h->sample) { lsample_pop(); }
+    if (h->profile >= 0 && lprof.on && lprof.generation == h->profile) { lprof_leave(); }
+}
+
+// Makes a call to lval_call_n, which it tells to go straight ahead
+lval* lhook_call_n(lenv* e, lval* f, lval** xs, int given) {
+    lhook_t h;
+    lhook_enter(&h, f);
+    lhook_direct = 1;
+    lval* r = lval_call_n(e, f, xs, given);
+    lhook_leave(&h);
+    return r;
+}
+
+// Calls f on the given arguments, taking the values but not the array
+// holding them, so callers looping over a list can reuse one
+lval* lval_call_n(lenv* e, lval* f, lval** xs, int given) {
+    if (lhooks) {
+        if (!lhook_direct) { return lhook_call_n(e, f, xs, given); }
+        lhook_direct = 0;
+    }
+
+    if (f->builtin) {
+        lval* a = lval_sexpr();
+        a->count = given;
+        a->cell = malloc(sizeof(lval*) * given);
+        memcpy(a->cell, xs, sizeof(lval*) * given);
+        return f->builtin(e, a);
+    }
+
+    lval* formals = f->code->formals;
+    int total = formals->count - f->bound;
+
+    if (given > total) {
+        for (int i = 0; i < given; i++) {
+            lval_del(xs[i]);
+        }
+        return lval_err(LERR_TOO_MANY, NULL, given, total);
+    }
+
+    if (given == total && !lprof.on) {
+        lval* r = f->code->native
+            ? lval_call_native(f, xs, given, f->code->native)
+            : ljit_call(e, f, xs, given);
+        if (r) { return r; }
+    }
+
+    // f is never modified, so it may be shared with the environment: the
+    // call gets a fresh frame holding any earlier partial bindings, then
+    // takes the arguments themselves into the following slots
+    lenv* env = lenv_frame(f->code);
+    for (int i = 0; i < f->bound; i++) {
+        env->vals[i] = lval_copy(f->env->vals[i]);
+    }
+    for (int i = 0; i < given; i++) {
+        env->vals[f->bound + i] = xs[i];
+    }
+    env->count = f->bound + given;
+
+    if (given < total) {
+        LREF_INC(f->code->refs);
+        return lval_closure(f->code, env, env->count);
+    }
+
+    env->par = e;
+    lval* result = builtin_eval(env, lval_add(lval_sexpr(), lval_copy(lcode_body(e, f->code))));
+    lenv_del(env);
+    return result;
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    if (f->builtin && !lhooks)
+        return f->builtin(e, a);
+    if (f->builtin) {
+        lhook_t h;
+        lhook_enter(&h, f);
+        lval* r = f->builtin(e, a);
+        lhook_leave(&h);
+        return r;
+    }
+
+    lval* r = lval_call_n(e, f, a->cell, a->count);
+    a->count = 0;
+    lval_del(a);
+    return r;
+}
+
+// Higher order list functions, calling f once per element with one
+// argument array reused throughout
+
+lval* builtin_map(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, LARG_ERR("map", a->count, 2));
+    LASSERT(a, a->cell[0]->type == LVAL_FUN, LTYPE_ERR("map", a->cell[0]->type, LVAL_FUN));
+    LASSERT(a, a->cell[1]->type == LVAL_QEXPR, LTYPE_ERR("map", a->cell[1]->type, LVAL_QEXPR));
+
+    // Results replace the elements in place
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+    lval* args[1];
+    for (int i = 0; i < l->count; i++) {
+        args[0] = l->cell[i];
+        l->cell[i] = lval_call_n(e, f, args, 1);
+        if (l->cell[i]->type == LVAL_ERR) {
+            lval* err = l->cell[i];
+            l->cell[i] = lval_sexpr();
+            lval_del(a);
+            return err;
+        }
+    }
+    return lval_take(a, 1);
+}
+
+// pmap shares its elements out between a pool of threads, each with a deque
+// of index ranges. A thread splits the range it takes in half, leaving the
+// upper half on its own deque, until what it keeps is no larger than the
+// grain. Idle threads steal the oldest, and so largest, range from another
+// deque. Results are stored back at their element's index, keeping order.
+
+#ifdef CLISP_THREADS
+
+#define LPOOL_DEQUE_MAX 64
+
+typedef struct {
+    int lo, hi;
+} lrange;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int top, bottom;
+    lrange ranges[LPOOL_DEQUE_MAX];
+} ldeque;
+
+struct {
+    int size;
+    pthread_t* threads;
+    ldeque* deques;
+    pthread_mutex_t busy;
+
+    // Helpers wait on start for the generation to move on, and the caller
+    // waits on done for all of them to finish with the job
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    long generation;
+    int active;
+    int quit;
+
+    lenv* env;
+    lval* f;
+    lval* list;
+    int grain;
+    int remaining;
+} lpool;
+
+pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+
+// The owner pushes and pops at the bottom, thieves take from the top
+int ldeque_push(ldeque* d, lrange r) {
+    int ok = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top < LPOOL_DEQUE_MAX) {
+        d->ranges[d->bottom++ % LPOOL_DEQUE_MAX] = r;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+int ldeque_pop(ldeque* d, lrange* r) {
+    int ok = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top) {
+        *r = d->ranges[--d->bottom % LPOOL_DEQUE_MAX];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+int ldeque_steal(ldeque* d, lrange* r) {
+    int ok = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top) {
+        *r = d->ranges[d->top++ % LPOOL_DEQUE_MAX];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+void lpool_work(int id) {
+    ldeque* own = &lpool.deques[id];
+    lval* args[1];
+    lrange r;
+    while (__atomic_load_n(&lpool.remaining, __ATOMIC_ACQUIRE) > 0) {
+        int found = ldeque_pop(own, &r);
+        for (int i = 1; i < lpool.size && !found; i++) {
+            found = ldeque_steal(&lpool.deques[(id + i) % lpool.size], &r);
+        }
+        if (!found) {
+            sched_yield();
+            continue;
+        }
+
+        while (r.hi - r.lo > lpool.grain) {
+            int mid = r.lo + (r.hi - r.lo) / 2;
+            if (!ldeque_push(own, (lrange){ mid, r.hi })) { break; }
+            r.hi = mid;
+        }
+
+        lval** cells = lpool.list->cell;
+        for (int i = r.lo; i < r.hi; i++) {
+            args[0] = cells[i];
+            cells[i] = lval_call_n(lpool.env, lpool.f, args, 1);
+        }
+        __atomic_sub_fetch(&lpool.remaining, r.hi - r.lo, __ATOMIC_ACQ_REL);
+    }
+}
+
+void* lpool_thread(void* arg) {
+    int id = (int)(long)arg;
+    long seen = 0;
+    lpool_worker = 1;
+
+    pthread_mutex_lock(&lpool.lock);
+    while (1) {
+        while (!lpool.quit && lpool.generation == seen) {
+            pthread_cond_wait(&lpool.start, &lpool.lock);
+        }
+        if (lpool.quit) { break; }
+        seen = lpool.generation;
+        pthread_mutex_unlock(&lpool.lock);
+
+        lpool_work(id);
+
+        pthread_mutex_lock(&lpool.lock);
+        if (--lpool.active == 0) { pthread_cond_signal(&lpool.done); }
+    }
+    pthread_mutex_unlock(&lpool.lock);
+    lheap_cleanup();
+    return NULL;
+}
+
+// One per processor, or CLISP_THREADS
+int lthread_count(void) {
+    char* n = getenv("CLISP_THREADS");
+    int count = n ? atoi(n) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return count < 1 ? 1 : count;
+}
+
+// The pool has lthread_count threads, counting the caller
+void lpool_start(void) {
+    lpool.size = lthread_count();
+
+    pthread_mutex_init(&lpool.busy, NULL);
+    pthread_mutex_init(&lpool.lock, NULL);
+    pthread_cond_init(&lpool.start, NULL);
+    pthread_cond_init(&lpool.done, NULL);
+    lpool.deques = calloc(lpool.size, sizeof(ldeque));
+    lpool.threads = malloc(sizeof(pthread_t) * lpool.size);
+    for (int i = 0; i < lpool.size; i++) {
+        pthread_mutex_init(&lpool.deques[i].lock, NULL);
+    }
+    for (int i = 1; i < lpool.size; i++) {
+        if (pthread_create(&lpool.threads[i], NULL, lpool_thread, (void*)(long)i) != 0) {
+            lpool.size = i;
+            break;
+        }
+    }
+}
+
+// Replaces every element of l with the result of applying f to it
+void lpool_map(lenv* e, lval* f, lval* l) {
+    lpool.env = e;
+    lpool.f = f;
+    lpool.list = l;
+    lpool.grain = l->count / (lpool.size * 8);
+    if (lpool.grain < 1) { lpool.grain = 1; }
+    lpool.remaining = l->count;
+
+    // Start each thread off with an equal share
+    for (int i = 0; i < lpool.size; i++) {
+        ldeque* d = &lpool.deques[i];
+        d->top = d->bottom = 0;
+        lrange r = { (int)((long)l->count * i / lpool.size),
+                     (int)((long)l->count * (i + 1) / lpool.size) };
+        if (r.hi > r.lo) { ldeque_push(d, r); }
+    }
+
+    pthread_mutex_lock(&lpool.lock);
+    lpool.generation++;
+    lpool.active = lpool.size - 1;
+    pthread_cond_broadcast(&lpool.start);
+    pthread_mutex_unlock(&lpool.lock);
+
+    lpool_worker = 1;
+    lpool_work(0);
+    lpool_worker = 0;
+
+    pthread_mutex_lock(&lpool.lock);
+    while (lpool.active > 0) {
+        pthread_cond_wait(&lpool.done, &lpool.lock);
+    }
+    pthread_mutex_unlock(&lpool.lock);
+}
+
+void lpool_cleanup(void) {
+    if (!lpool.threads) { return; }
+
+    pthread_mutex_lock(&lpool.lock);
+    lpool.quit = 1;
+    pthread_cond_broadcast(&lpool.start);
+    pthread_mutex_unlock(&lpool.lock);
+    for (int i = 1; i < lpool.size; i++) {
+        pthread_join(lpool.threads[i], NULL);
+    }
+    free(lpool.threads);
+    free(lpool.deques);
+}
+
+#else
+
+void lpool_cleanup(void) {}
+
+#endif
+
+lval* builtin_pmap(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, LARG_ERR("pmap", a->count, 2));
+    LASSERT(a, a->cell[0]->type == LVAL_FUN, LTYPE_ERR("pmap", a->cell[0]->type, LVAL_FUN));
+    LASSERT(a, a->cell[1]->type == LVAL_QEXPR, LTYPE_ERR("pmap", a->cell[1]->type, LVAL_QEXPR));
+
+#ifdef CLISP_THREADS
+    // A pmap nested inside another, or made while the pool is busy with
+    // one from another interpreter, runs on its own thread
+    lval* l = a->cell[1];
+    if (!lpool_worker && l->count > 1) { pthread_once(&lpool_once, lpool_start); }
+    if (!lpool_worker && l->count > 1 && lpool.size > 1
+            && pthread_mutex_trylock(&lpool.busy) == 0) {
+        lpool_map(e, a->cell[0], l);
+        pthread_mutex_unlock(&lpool.busy);
+
+        // Every element has been applied, so report the first error
+        for (int i = 0; i < l->count; i++) {
+            if (l->cell[i]->type == LVAL_ERR) {
+                lval* err = l->cell[i];
+                l->cell[i] = lval_sexpr();
+                lval_del(a);
+                return err;
+            }
+        }
+        return lval_take(a, 1);
+    }
+#endif
+
+    // Otherwise run in order on this thread, under the same rules
+    int worker = lpool_worker;
+    lpool_worker = 1;
+    lval* r = builtin_map(e, a);
+    lpool_worker = worker;
+    return r;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, LARG_ERR("filter", a->count, 2));
+    LASSERT(a, a->cell[0]->type == LVAL_FUN, LTYPE_ERR("filter", a->cell[0]->type, LVAL_FUN));
+    LASSERT(a, a->cell[1]->type == LVAL_QEXPR, LTYPE_ERR("filter", a->cell[1]->type, LVAL_QEXPR));
+
+    // Kept elements are compacted towards the front, and any non-zero
+    // number counts as true
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+    lval* args[1];
+    int kept = 0;
+    for (int i = 0; i < l->count; i++) {
+        args[0] = lval_copy(l->cell[i]);
+        lval* r = lval_call_n(e, f, args, 1);
+        if (r->type != LVAL_NUM) {
+            lval* err = r->type == LVAL_ERR ? r : LTYPE_ERR("filter", r->type, LVAL_NUM);
+            if (err != r) { lval_del(r); }
+            for (int j = i; j < l->count; j++) {
+                lval_del(l->cell[j]);
+            }
+            l->count = kept;
+            lval_del(a);
+            return err;
+        }
+
+        if (r->num) {
+            l->cell[kept++] = l->cell[i];
+        } else {
+            lval_del(l->cell[i]);
+        }
+        lval_del(r);
+    }
+    l->count = kept;
+    return lval_take(a, 1);
+}
+
+lval* builtin_fold(lenv* e, lval* a, char* func) {
+    LASSERT(a, a->count == 3, LARG_ERR(func, a->count, 3));
+    LASSERT(a, a->cell[0]->type == LVAL_FUN, LTYPE_ERR(func, a->cell[0]->type, LVAL_FUN));
+    LASSERT(a, a->cell[2]->type == LVAL_QEXPR, LTYPE_ERR(func, a->cell[2]->type, LVAL_QEXPR));
+
+    // Elements are taken out of the list as they are used, foldl's from the
+    // front, and any left after an error are freed with the list
+    lval* f = a->cell[0];
+    lval* l = a->cell[2];
+    lval* acc = a->cell[1];
+    a->cell[1] = lval_sexpr();
+    lval* args[2];
+    int left = strcmp(func, "foldl") == 0;
+    int used = 0;
+    while (used < l->count && acc->type != LVAL_ERR) {
+        if (left) {
+            args[0] = acc;
+            args[1] = l->cell[used++];
+        } else {
+            args[0] = l->cell[--l->count];
+            args[1] = acc;
+        }
+        acc = lval_call_n(e, f, args, 2);
+    }
+    l->count -= used;
+    memmove(&l->cell[0], &l->cell[used], sizeof(lval*) * l->count);
+
+    lval_del(a);
+    return acc;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+    return builtin_fold(e, a, "foldl");
+}
+
+lval* builtin_foldr(lenv* e, lval* a) {
+    return builtin_fold(e, a, "foldr");
+}
+
+// future evaluates a Q-Expression on another thread, against a snapshot of
+// the bindings visible where it was made, so later changes to globals are
+// not seen by it. await returns its value. A thread waiting on a future no
+// thread has taken yet runs it itself, so a future waiting on another never
+// holds up the scheduler.
+
+// The bindings visible from e, flattened into a new root. Globals are only
+// ever replaced, never changed in place, so the snapshot shares their values
+// rather than copying them. Roots keep their snapshot until a global
+// changes, so futures made at top level share one, and a snapshot is its own.
+lenv* lenv_snapshot(lenv* e) {
+    if (!e->par && lsched_worker) { return lenv_ref(e); }
+    long version = lsite_current();
+    if (!e->par && e->snap && e->snap_version == version) {
+        return lenv_ref(e->snap);
+    }
+
+    int total = 0;
+    for (lenv* p = e; p; p = p->par) { total += p->count; }
+
+    // Names taken from inner frames, in an open addressed table, so outer
+    // bindings they shadow are left out
+    int slots = 0;
+    char** seen = NULL;
+    if (e->par) {
+        slots = 16;
+        while (slots < total * 2) { slots *= 2; }
+        seen = calloc(slots, sizeof(char*));
+    }
+
+    lenv* s = lenv_new();
+    s->syms = malloc(sizeof(char*) * (total ? total : 1));
+    s->vals = malloc(sizeof(lval*) * (total ? total : 1));
+    for (lenv* p = e; p; p = p->par) {
+        for (int i = 0; i < p->count; i++) {
+            char* sym = p->syms[i];
+            if (seen) {
+                unsigned long h = lcache_hash(sym, strlen(sym)) & (slots - 1);
+                while (seen[h] && strcmp(seen[h], sym) != 0) { h = (h + 1) & (slots - 1); }
+                if (seen[h]) { continue; }
+                seen[h] = sym;
+            }
+
+            s->syms[s->count] = malloc(strlen(sym) + 1);
+            strcpy(s->syms[s->count], sym);
+            if (p->par) {
+                s->vals[s->count] = lval_copy(p->vals[i]);
+            } else {
+                s->vals[s->count] = p->vals[i];
+                LREF_INC(p->vals[i]->refs);
+            }
+            s->count++;
+        }
+    }
+    free(seen);
+
+    // pmap workers share the root, so leave it be
+    if (!e->par && !lpool_worker) {
+        if (e->snap) { lenv_del(e->snap); }
+        e->snap = lenv_ref(s);
+        e->snap_version = version;
+    }
+    return s;
+}
+
+void lfuture_del(lfuture* f) {
+    if (LREF_DEC(f->refs) > 0) { return; }
+    if (f->env) { lenv_del(f->env); }
+    if (f->expr) { lval_del(f->expr); }
+    if (f->value) { lval_del(f->value); }
+    free(f);
+}
+
+// Evaluates the expression of a future the caller has claimed
+lval* lfuture_eval(lfuture* f) {
+    int pool = lpool_worker;
+    int sched = lsched_worker;
+    lpool_worker = 1;
+    lsched_worker = 1;
+    lval* x = lval_eval(f->env, f->expr);
+    lpool_worker = pool;
+    lsched_worker = sched;
+
+    f->expr = NULL;
+    lenv_del(f->env);
+    f->env = NULL;
+    return x;
+}
+
+#ifdef CLISP_THREADS
+
+struct {
+    int size;
+    pthread_t* threads;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    lfuture* head;
+    lfuture* tail;
+    int quit;
+} lsched = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+pthread_once_t lsched_once = PTHREAD_ONCE_INIT;
+
+// Runs a future claimed with the lock held, returning with it held again
+void lfuture_run(lfuture* f) {
+    f->state = LFUT_RUNNING;
+    pthread_mutex_unlock(&lsched.lock);
+    lval* x = lfuture_eval(f);
+    pthread_mutex_lock(&lsched.lock);
+    f->value = x;
+    f->state = LFUT_DONE;
+    pthread_cond_broadcast(&lsched.done);
+}
+
+// Futures taken by a waiting thread are left in the queue, and dropped
+// by the scheduler when it reaches them
+void* lsched_thread(void* arg) {
+    pthread_mutex_lock(&lsched.lock);
+    while (1) {
+        while (!lsched.quit && !lsched.head) {
+            pthread_cond_wait(&lsched.queued, &lsched.lock);
+        }
+        if (lsched.quit) { break; }
+
+        lfuture* f = lsched.head;
+        lsched.head = f->next;
+        if (!lsched.head) { lsched.tail = NULL; }
+        if (f->state == LFUT_QUEUED) { lfuture_run(f); }
+
+        pthread_mutex_unlock(&lsched.lock);
+        lfuture_del(f);
+        pthread_mutex_lock(&lsched.lock);
+    }
+    pthread_mutex_unlock(&lsched.lock);
+    lheap_cleanup();
+    return NULL;
+}
+
+// One thread fewer than the pool, leaving a processor for the caller
+void lsched_start(void) {
+    lsched.size = lthread_count() - 1;
+    if (lsched.size < 1) { lsched.size = 1; }
+    lsched.threads = malloc(sizeof(pthread_t) * lsched.size);
+    for (int i = 0; i < lsched.size; i++) {
+        if (pthread_create(&lsched.threads[i], NULL, lsched_thread, NULL) != 0) {
+            lsched.size = i;
+            break;
+        }
+    }
+}
+
+// Without a scheduler thread futures are run when awaited
+void lfuture_submit(lfuture* f) {
+    pthread_once(&lsched_once, lsched_start);
+    LREF_INC(f->refs);
+    pthread_mutex_lock(&lsched.lock);
+    f->next = NULL;
+    if (lsched.tail) {
+        lsched.tail->next = f;
+    } else {
+        lsched.head = f;
+    }
+    lsched.tail = f;
+    pthread_cond_signal(&lsched.queued);
+    pthread_mutex_unlock(&lsched.lock);
+}
+
+// The value of f, still owned by it
+lval* lfuture_wait(lfuture* f) {
+    pthread_mutex_lock(&lsched.lock);
+    if (f->state == LFUT_QUEUED) { lfuture_run(f); }
+    while (f->state != LFUT_DONE) {
+        pthread_cond_wait(&lsched.done, &lsched.lock);
+    }
+    pthread_mutex_unlock(&lsched.lock);
+    return f->value;
+}
+
+// The first of fs to be done, running one that has not started if none are
+lfuture* lfuture_wait_any(lfuture** fs, int n) {
+    pthread_mutex_lock(&lsched.lock);
+    while (1) {
+        for (int i = 0; i < n; i++) {
+            if (fs[i]->state == LFUT_DONE) {
+                pthread_mutex_unlock(&lsched.lock);
+                return fs[i];
+            }
+        }
+        int i = 0;
+        while (i < n && fs[i]->state != LFUT_QUEUED) { i++; }
+        if (i < n) {
+            lfuture_run(fs[i]);
+        } else {
+            pthread_cond_wait(&lsched.done, &lsched.lock);
+        }
+    }
+}
+
+void lsched_cleanup(void) {
+    if (!lsched.threads) { return; }
+
+    pthread_mutex_lock(&lsched.lock);
+    lsched.quit = 1;
+    pthread_cond_broadcast(&lsched.queued);
+    pthread_mutex_unlock(&lsched.lock);
+    for (int i = 0; i < lsched.size; i++) {
+        pthread_join(lsched.threads[i], NULL);
+    }
+    free(lsched.threads);
+
+    // Whatever was never started
+    while (lsched.head) {
+        lfuture* f = lsched.head;
+        lsched.head = f->next;
+        lfuture_del(f);
+    }
+}
+
+#else
+
+// Without threads a future is evaluated when it is made
+void lfuture_submit(lfuture* f) {
+    f->value = lfuture_eval(f);
+    f->state = LFUT_DONE;
+}
+
+lval* lfuture_wait(lfuture* f) {
+    return f->value;
+}
+
+lfuture* lfuture_wait_any(lfuture** fs, int n) {
+    return fs[0];
+}
+
+void lsched_cleanup(void) {}
+
+#endif
+
+// Takes over the caller's reference to env
+lfuture* lfuture_new(lenv* env, lval* expr) {
+    lfuture* f = malloc(sizeof(lfuture));
+    f->refs = 1;
+    f->state = LFUT_QUEUED;
+    f->env = env;
+    f->expr = expr;
+    f->value = NULL;
+    return f;
+}
+
+lval* builtin_future(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("future", a->count, 1));
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+            LTYPE_ERR("future", a->cell[0]->type, LVAL_QEXPR));
+
+    lval* x = lval_take(a, 0);
+    x->type = LVAL_SEXPR;
+    lfuture* f = lfuture_new(lenv_snapshot(e), x);
+    lfuture_submit(f);
+
+    lval* v = lval_alloc();
+    v->type = LVAL_FUTURE;
+    v->fut = f;
+    return v;
+}
+
+lval* builtin_await(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("await", a->count, 1));
+    LASSERT(a, a->cell[0]->type == LVAL_FUTURE,
+            LTYPE_ERR("await", a->cell[0]->type, LVAL_FUTURE));
+
+    lval* x = lval_copy(lfuture_wait(a->cell[0]->fut));
+    lval_del(a);
+    return x;
+}
+
+// all and any take futures as arguments or in a single Q-Expression
+lval* lfuture_args(lval* a, char* func) {
+    if (a->count == 1 && a->cell[0]->type == LVAL_QEXPR) {
+        a = lval_take(a, 0);
+    }
+    LASSERT(a, a->count > 0, LEMP_ERR(func));
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, a->cell[i]->type == LVAL_FUTURE,
+                LTYPE_ERR(func, a->cell[i]->type, LVAL_FUTURE));
+    }
+    return a;
+}
+
+// The values of every future in order, or the first error among them
+lval* builtin_all(lenv* e, lval* a) {
+    a = lfuture_args(a, "all");
+    if (a->type == LVAL_ERR) { return a; }
+
+    lval* err = NULL;
+    for (int i = 0; i < a->count; i++) {
+        lval* x = lval_copy(lfuture_wait(a->cell[i]->fut));
+        lval_del(a->cell[i]);
+        a->cell[i] = x;
+        if (x->type == LVAL_ERR && !err) { err = x; }
+    }
+    if (err) {
+        err = lval_copy(err);
+        lval_del(a);
+        return err;
+    }
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+// The value of whichever future is done first
+lval* builtin_any(lenv* e, lval* a) {
+    a = lfuture_args(a, "any");
+    if (a->type == LVAL_ERR) { return a; }
+
+    lfuture* fs[a->count];
+    for (int i = 0; i < a->count; i++) {
+        fs[i] = a->cell[i]->fut;
+    }
+    lval* x = lval_copy(lfuture_wait_any(fs, a->count)->value);
+    lval_del(a);
+    return x;
+}
+
+// par evaluates an S-Expression given as a Q-Expression like eval, but with
+// every child expensive enough run as a future. Cheap children stay on the
+// calling thread, and with fewer than two expensive ones it is just eval.
+
+#define LPAR_CALL_COST 64
+#define LPAR_MIN_COST 64
+
+// A rough cost of evaluating x: one per call, plus LPAR_CALL_COST for each
+// lambda named inside it that has not been compiled
+int lpar_cost(lenv* e, lval* x) {
+    if (x->type != LVAL_SEXPR) { return 0; }
+
+    int cost = 1;
+    for (int i = 0; i < x->count; i++) {
+        lval* y = x->cell[i];
+        if (y->type != LVAL_SYM) {
+            cost += lpar_cost(e, y);
+            continue;
+        }
+        lval* f = lenv_lookup(e, y->sym);
+        if (f && f->type == LVAL_FUN && !f->builtin && !f->code->jit) {
+            cost += LPAR_CALL_COST;
+        }
+    }
+    return cost;
+}
+
+lval* builtin_par(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("par", a->count, 1));
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+            LTYPE_ERR("par", a->cell[0]->type, LVAL_QEXPR));
+
+    lval* v = lval_take(a, 0);
+    v->type = LVAL_SEXPR;
+
+    int n = 0;
+    int expensive[v->count];
+    for (int i = 0; i < v->count; i++) {
+        expensive[i] = lpar_cost(e, v->cell[i]) >= LPAR_MIN_COST;
+        n += expensive[i];
+    }
+    if (n < 2) { return lval_eval(e, v); }
+
+    // The children share one snapshot
+    lenv* snap = lenv_snapshot(e);
+    lfuture* fs[v->count];
+    for (int i = 0; i < v->count; i++) {
+        if (expensive[i]) {
+            fs[i] = lfuture_new(lenv_ref(snap), v->cell[i]);
+            lfuture_submit(fs[i]);
+        }
+    }
+    lenv_del(snap);
+
+    for (int i = 0; i < v->count; i++) {
+        if (expensive[i]) { continue; }
+        v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+    for (int i = 0; i < v->count; i++) {
+        if (!expensive[i]) { continue; }
+        v->cell[i] = lval_copy(lfuture_wait(fs[i]));
+        lfuture_del(fs[i]);
+    }
+    return lval_apply(e, v);
+}
+
+// Channels carry messages between threads. send hands over the value it
+// is given and recv hands that same value to the receiver, so nothing is
+// copied on the way. The queue itself takes no locks. A thread finding it
+// full or empty sleeps until another sends or receives on any channel.
+
+lval* lval_chan(long size) {
+    lchan* c = malloc(sizeof(lchan));
+    c->refs = 1;
+    c->mask = size - 1;
+    c->slots = malloc(sizeof(lslot) * size);
+    for (long i = 0; i < size; i++) {
+        c->slots[i].seq = i;
+    }
+    c->head = 0;
+    c->tail = 0;
+
+    lval* v = lval_alloc();
+    v->type = LVAL_CHAN;
+    v->chan = c;
+    return v;
+}
+
+int lchan_push(lchan* c, lval** v) {
+    long pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+    while (1) {
+        lslot* slot = &c->slots[pos & c->mask];
+        long dif = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos;
+        if (dif < 0) { return 0; }
+        if (dif == 0 && __atomic_compare_exchange_n(&c->head, &pos, pos + 1, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            slot->v = *v;
+            __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+        if (dif > 0) { pos = __atomic_load_n(&c->head, __ATOMIC_RELAXED); }
+    }
+}
+
+int lchan_pop(lchan* c, lval** v) {
+    long pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED);
+    while (1) {
+        lslot* slot = &c->slots[pos & c->mask];
+        long dif = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1);
+        if (dif < 0) { return 0; }
+        if (dif == 0 && __atomic_compare_exchange_n(&c->tail, &pos, pos + 1, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            *v = slot->v;
+            __atomic_store_n(&slot->seq, pos + c->mask + 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+        if (dif > 0) { pos = __atomic_load_n(&c->tail, __ATOMIC_RELAXED); }
+    }
+}
+
+void lchan_del(lchan* c) {
+    if (LREF_DEC(c->refs) > 0) { return; }
+
+    lval* v;
+    while (lchan_pop(c, &v)) {
+        lval_del(v);
+    }
+    free(c->slots);
+    free(c);
+}
+
+#ifdef CLISP_THREADS
+
+pthread_mutex_t lchan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lchan_cond = PTHREAD_COND_INITIALIZER;
+int lchan_sleepers = 0;
+int lchan_quit = 0;
+
+// Threads started by spawn and not yet finished, guarded by lsched.lock
+int lspawn_live = 0;
+
+// The fences order a change to a queue against reading or bumping the
+// count of sleepers, so either the sleeper sees the change or the thread
+// making it sees the sleeper
+void lchan_wake(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lchan_sleepers, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&lchan_lock);
+        pthread_cond_broadcast(&lchan_cond);
+        pthread_mutex_unlock(&lchan_lock);
+    }
+}
+
+// Retries op until it succeeds, or returns 0 once the program is exiting
+int lchan_wait(lchan* c, lval** v, int (*op)(lchan*, lval**)) {
+    while (!op(c, v)) {
+        pthread_mutex_lock(&lchan_lock);
+        __atomic_add_fetch(&lchan_sleepers, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int done = op(c, v);
+        if (!done && !lchan_quit) {
+            pthread_cond_wait(&lchan_cond, &lchan_lock);
+        }
+        __atomic_sub_fetch(&lchan_sleepers, 1, __ATOMIC_RELAXED);
+        int quit = lchan_quit;
+        pthread_mutex_unlock(&lchan_lock);
+
+        if (done) { break; }
+        if (quit) { return 0; }
+    }
+    lchan_wake();
+    return 1;
+}
+
+void* lspawn_thread(void* arg) {
+    lfuture* f = arg;
+    lval* x = lfuture_eval(f);
+
+    pthread_mutex_lock(&lsched.lock);
+    f->value = x;
+    f->state = LFUT_DONE;
+    lspawn_live--;
+    pthread_cond_broadcast(&lsched.done);
+    pthread_mutex_unlock(&lsched.lock);
+
+    lfuture_del(f);
+    lheap_cleanup();
+    return NULL;
+}
+
+int lspawn_start(lfuture* f) {
+    pthread_attr_t attr;
+    pthread_t t;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    LREF_INC(f->refs);
+    pthread_mutex_lock(&lsched.lock);
+    lspawn_live++;
+    pthread_mutex_unlock(&lsched.lock);
+    int ok = pthread_create(&t, &attr, lspawn_thread, f) == 0;
+    if (!ok) {
+        pthread_mutex_lock(&lsched.lock);
+        lspawn_live--;
+        pthread_mutex_unlock(&lsched.lock);
+        LREF_DEC(f->refs);
+    }
+    pthread_attr_destroy(&attr);
+    return ok;
+}
+
+// Fails whatever is blocked on a channel, then waits for every spawned
+// thread to finish
+void lchan_cleanup(void) {
+    pthread_mutex_lock(&lchan_lock);
+    lchan_quit = 1;
+    pthread_cond_broadcast(&lchan_cond);
+    pthread_mutex_unlock(&lchan_lock);
+
+    pthread_mutex_lock(&lsched.lock);
+    while (lspawn_live > 0) {
+        pthread_cond_wait(&lsched.done, &lsched.lock);
+    }
+    pthread_mutex_unlock(&lsched.lock);
+}
+
+#else
+
+// With one thread, waiting on a channel would never end
+int lchan_wait(lchan* c, lval** v, int (*op)(lchan*, lval**)) {
+    return op(c, v);
+}
+
+int lspawn_start(lfuture* f) {
+    return 0;
+}
+
+void lchan_cleanup(void) {}
+
+#endif
+
+// A channel holding up to the given number of messages, rounded up to a
+// power of two
+lval* builtin_chan(lenv* e, lval* a) {
+    LASSERT(a, a->count <= 1, LARG_ERR("chan", a->count, 1));
+    long size = LCHAN_SIZE;
+    if (a->count == 1) {
+        LASSERT(a, a->cell[0]->type == LVAL_NUM,
+                LTYPE_ERR("chan", a->cell[0]->type, LVAL_NUM));
+        LASSERT(a, a->cell[0]->num > 0 && a->cell[0]->num <= LCHAN_MAX,
+                lval_err(LERR_NUM, NULL, 0, 0));
+        for (size = 1; size < a->cell[0]->num; size *= 2) {}
+    }
+    lval_del(a);
+    return lval_chan(size);
+}
+
+lval* builtin_send(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, LARG_ERR("send", a->count, 2));
+    LASSERT(a, a->cell[0]->type == LVAL_CHAN,
+            LTYPE_ERR("send", a->cell[0]->type, LVAL_CHAN));
+
+    lval* x = lval_pop(a, 1);
+    if (!lchan_wait(a->cell[0]->chan, &x, lchan_push)) {
+        lval_del(x);
+        lval_del(a);
+        return lval_err(LERR_BLOCKED, "send", 0, 0);
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_recv(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("recv", a->count, 1));
+    LASSERT(a, a->cell[0]->type == LVAL_CHAN,
+            LTYPE_ERR("recv", a->cell[0]->type, LVAL_CHAN));
+
+    lval* x;
+    int ok = lchan_wait(a->cell[0]->chan, &x, lchan_pop);
+    lval_del(a);
+    return ok ? x : lval_err(LERR_BLOCKED, "recv", 0, 0);
+}
+
+// Like future, but on a thread of its own, so it may block on channels for
+// as long as it likes without holding up the scheduler
+lval* builtin_spawn(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("spawn", a->count, 1));
+    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+            LTYPE_ERR("spawn", a->cell[0]->type, LVAL_QEXPR));
+
+    lval* x = lval_take(a, 0);
+    x->type = LVAL_SEXPR;
+    lfuture* f = lfuture_new(lenv_snapshot(e), x);
+    f->state = LFUT_RUNNING;
+    if (!lspawn_start(f)) {
+        f->value = lfuture_eval(f);
+        f->state = LFUT_DONE;
+    }
+
+    lval* v = lval_alloc();
+    v->type = LVAL_FUTURE;
+    v->fut = f;
+    return v;
+}
+
+// {what count mean-us M max-us X p50-us A p99-us B}
+lval* lstats_list(lstats_t* s, char* what) {
+    long values[] = {
+        s->count, s->count ? s->total / s->count : 0, s->max,
+        lstats_percentile(s, 50), lstats_percentile(s, 99),
+    };
+    char* names[] = { what, "mean-us", "max-us", "p50-us", "p99-us" };
+    lval* x = lval_qexpr();
+    for (int i = 0; i < 5; i++) {
+        x = lval_add(x, lval_sym(names[i]));
+        x = lval_add(x, lval_num(values[i]));
+    }
+    return x;
+}
+
+// Latencies of requests answered by clisp --serve, from reading the line to
+// the socket taking the whole reply
+lstats_t lserve_stats;
+
+lval* builtin_server_stats(lenv* e, lval* a) {
+    lval_del(a);
+    return lstats_list(&lserve_stats, "requests");
+}
+
+lval* builtin_gc_stats(lenv* e, lval* a) {
+    lval_del(a);
+    LLOCK(lreclaim_lock);
+    lval* x = lstats_list(&lreclaim_stats, "pauses");
+    LUNLOCK(lreclaim_lock);
+    return x;
+}
+
+lval* builtin_profile_start(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LARG_ERR("profile-start", a->count, 0));
+    LASSERT(a, !lpool_worker, lval_err(LERR_WORKER, "profile-start", 0, 0));
+    lval_del(a);
+    lprof_start();
+    return lval_sexpr();
+}
+
+// (profile-stop), (profile-stop "calls") or (profile-stop "calls" "prof.csv")
+lval* builtin_profile_stop(lenv* e, lval* a) {
+    LASSERT(a, a->count <= 2, LARG_ERR("profile-stop", a->count, 2));
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, a->cell[i]->type == LVAL_STR,
+                LTYPE_ERR("profile-stop", a->cell[i]->type, LVAL_STR));
+    }
+
+    int key = a->count > 0 ? 0 : LPROF_SELF;
+    while (a->count > 0 && key < LPROF_COUNT && strcmp(lprof_keys[key], a->cell[0]->str) != 0) {
+        key++;
+    }
+    if (key == LPROF_COUNT) {
+        lval* err = lval_err_owned(LERR_SORT, a->cell[0]->str);
+        lval_del(a);
+        return err;
+    }
+
+    lval* x = lprof_stop(key, a->count == 2 ? a->cell[1]->str : NULL);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_print_env(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LARG_ERR("print-env", a->count, 0));
+
+    lbuf b = {0};
+    for (int i = 0; i < e->count; i++) {
+        lbuf_puts(&b, e->syms[i]);
+        lbuf_puts(&b, ": ");
+        lval_write(&b, e->vals[i]);
+        lbuf_putc(&b, '\n');
+    }
+    lbuf_flush(&b, lout());
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_to_string(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("to-string", a->count, 1));
+
+    lbuf b = {0};
+    lval_write(&b, a->cell[0]);
+    char* s = lbuf_take(&b);
+    lval* x = lval_str(s);
+    free(s);
+
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_exit(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LARG_ERR("exit", a->count, 0));
+
+    exit(0);
+    return lval_sexpr();
+}
+
+// Lambda bodies are simplified once, when `fn` makes them: applications of
+// side-effect free builtins to constants are evaluated. Only builtins are
+// folded, and only under names no lambda takes as a formal, since with
+// dynamic scope anything else may mean something different by the time the
+// body runs. The body as written is kept, and is what runs from the first
+// time one of the folded names is found bound to something else.
+
+lbuiltin lfold_pure[] = {
+    builtin_list, builtin_head, builtin_tail, builtin_join, builtin_cons,
+    builtin_len, builtin_init, builtin_add, builtin_sub, builtin_mul,
+    builtin_div, builtin_to_string, NULL
+};
+
+int lfold_is_const(lval* v) {
+    return v->type == LVAL_NUM || v->type == LVAL_STR || v->type == LVAL_QEXPR;
+}
+
+// The function a call applies, if its name cannot be rebound by a caller
+lval* lfold_head(lenv* e, lval* x) {
+    if (x->count == 0 || x->cell[0]->type != LVAL_SYM) { return NULL; }
+    if (lsite_is_local(x->cell[0]->sym)) { return NULL; }
+
+    lval* f = lenv_lookup(e, x->cell[0]->sym);
+    return f && f->type == LVAL_FUN ? f : NULL;
+}
+
+int lfold_is_pure(lval* f) {
+    for (int i = 0; lfold_pure[i]; i++) {
+        if (f->builtin == lfold_pure[i]) { return 1; }
+    }
+    return 0;
+}
+
+// Folds x, adding the name and builtin of each fold made to folds
+lval* lval_fold(lenv* e, lval* x, lval* folds) {
+    if (x->type != LVAL_SEXPR) { return x; }
+
+    for (int i = 0; i < x->count; i++) {
+        x->cell[i] = lval_fold(e, x->cell[i], folds);
+    }
+
+    lval* f = x->count > 1 ? lfold_head(e, x) : NULL;
+    if (!f || !f->builtin || !lfold_is_pure(f)) { return x; }
+
+    for (int i = 1; i < x->count; i++) {
+        if (!lfold_is_const(x->cell[i])) { return x; }
+    }
+
+    // Errors are left for the call to raise when it actually happens
+    lval* args = lval_copy(x);
+    lval_del(lval_pop(args, 0));
+    lval* r = f->builtin(e, args);
+    if (r->type == LVAL_ERR) {
+        lval_del(r);
+        return x;
+    }
+    lval_add(folds, lval_copy(x->cell[0]));
+    lval_add(folds, lval_copy(f));
+    lval_del(x);
+    return r;
+}
+
+lval* lval_fold_body(lenv* e, lval* body, lval* folds) {
+    body->type = LVAL_SEXPR;
+    body = lval_fold(e, body, folds);
+    if (body->type == LVAL_SEXPR) {
+        body->type = LVAL_QEXPR;
+        return body;
+    }
+    return lval_add(lval_qexpr(), body);
+}
+
+lval* builtin_fn_body(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("fn-body", a->count, 1));
+    LASSERT(a, a->cell[0]->type == LVAL_FUN && !a->cell[0]->builtin,
+            LTYPE_ERR("fn-body", a->cell[0]->type, LVAL_FUN));
+
+    lval* x = lval_copy(lcode_body(e, a->cell[0]->code));
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, LARG_ERR("fn", a->count, 2));
+    LASSERT(a, a->cell[0]->type, LTYPE_ERR("fn", a->cell[0]->type, LVAL_QEXPR));
+    LASSERT(a, a->cell[1]->type, LTYPE_ERR("fn", a->cell[1]->type, LVAL_QEXPR));
+
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM, LTYPE_ERR("fn", a->cell[0]->cell[i]->type, LVAL_SYM));
+    }
+
+    int src = a->src;
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+    lval_del(a);
+
+    // Formals are recorded as local names before folding, so the body's
+    // own uses of them are never mistaken for globals
+    for (int i = 0; i < formals->count; i++) {
+        lsite_local(formals->cell[i]->sym);
+    }
+    lval* source = NULL;
+    lval* folds = NULL;
+    if (body->type == LVAL_QEXPR) {
+        source = lval_copy(body);
+        folds = lval_qexpr();
+        body = lval_fold_body(e, body, folds);
+        if (folds->count == 0) {
+            lval_del(source);
+            lval_del(folds);
+            source = NULL;
+            folds = NULL;
+        }
+    }
+
+    lval* f = lval_lambda(formals, body);
+    f->code->source = source;
+    f->code->folds = folds;
+    f->code->fold_version = lsite_current();
+    f->code->src = src;
+    return f;
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lval* v = lval_fun(func);
+    v->sym = malloc(strlen(name) + 1);
+    strcpy(v->sym, name);
+    lenv_def(e, k, v);
+    lval_del(k);
+    lval_del(v);
+}
+
+void lenv_add_sbuiltin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lval* v = lval_sfun(func);
+    v->sym = malloc(strlen(name) + 1);
+    strcpy(v->sym, name);
+    lenv_put(e, k, v);
+    lval_del(k);
+    lval_del(v);
+}
+
+// The C name of each builtin is kept for the compiler to call it by
+typedef struct {
+    char* name;
+    lbuiltin func;
+    char* cname;
+    int special;
+} lbuiltin_t;
+
+#define LBUILTIN(name, func) { name, func, #func, 0 }
+#define LSBUILTIN(name, func) { name, func, #func, 1 }
+
+extern lbuiltin_t lbuiltins[];
+
+// Images hold every global binding, written out by save-image and read back
+// by load-image or clisp --image. Everything is stored by value in a fixed
+// little endian layout, so an image has no pointers to fix up: builtins are
+// stored by name, and lambda code and closure environments by their index
+// among those already written, which keeps them shared when read back.
+
+#define LIMAGE_MAGIC "CLISPIMG"
+#define LIMAGE_VERSION 1
+
+typedef struct {
+    lbuf out;
+    unsigned char* data;
+    size_t len;
+    size_t pos;
+    int bad;
+    int ncodes;
+    lcode** codes;
+    int nenvs;
+    lenv** envs;
+} limage_t;
+
+int limage_find(void** items, int n, void* p) {
+    for (int i = 0; i < n; i++) {
+        if (items[i] == p) { return i; }
+    }
+    return -1;
+}
+
+void limage_put(limage_t* m, unsigned long x, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        lbuf_putc(&m->out, (x >> (8 * i)) & 0xFF);
+    }
+}
+
+void limage_put_str(limage_t* m, char* s) {
+    limage_put(m, strlen(s), 4);
+    lbuf_puts(&m->out, s);
+}
+
+lbuiltin_t* limage_builtin_func(lbuiltin func) {
+    for (int i = 0; lbuiltins[i].name; i++) {
+        if (lbuiltins[i].func == func) { return &lbuiltins[i]; }
+    }
+    return NULL;
+}
+
+lbuiltin_t* limage_builtin_name(char* name) {
+    for (int i = 0; lbuiltins[i].name; i++) {
+        if (strcmp(lbuiltins[i].name, name) == 0) { return &lbuiltins[i]; }
+    }
+    return NULL;
+}
+
+void limage_write(limage_t* m, lval* v) {
+    // Futures are stored as the value they come to
+    if (v->type == LVAL_FUTURE) {
+        limage_write(m, lfuture_wait(v->fut));
+        return;
+    }
+
+    limage_put(m, v->type, 1);
+    switch (v->type) {
+        case LVAL_NUM: limage_put(m, v->num, 8); break;
+        case LVAL_SYM: limage_put_str(m, v->sym); break;
+        case LVAL_STR: limage_put_str(m, v->str); break;
+
+        case LVAL_ERR:
+            limage_put(m, v->err, 4);
+            limage_put_str(m, v->err_name ? v->err_name : "");
+            limage_put(m, v->err_args[0], 8);
+            limage_put(m, v->err_args[1], 8);
+            break;
+
+        case LVAL_SFUN:
+        case LVAL_FUN:
+            if (v->builtin) {
+                limage_put(m, 0, 1);
+                limage_put_str(m, limage_builtin_func(v->builtin)->name);
+                limage_put_str(m, v->sym);
+                break;
+            }
+
+            limage_put(m, 1, 1);
+            int c = limage_find((void**)m->codes, m->ncodes, v->code);
+            limage_put(m, c < 0 ? m->ncodes : c, 4);
+            if (c < 0) {
+                m->ncodes++;
+                m->codes = realloc(m->codes, sizeof(lcode*) * m->ncodes);
+                m->codes[m->ncodes - 1] = v->code;
+                limage_write(m, v->code->formals);
+                limage_write(m, v->code->source ? v->code->source : v->code->body);
+            }
+
+            // Environment indices are offset by one, zero meaning none
+            if (!v->env) {
+                limage_put(m, 0, 4);
+                break;
+            }
+            int e = limage_find((void**)m->envs, m->nenvs, v->env);
+            limage_put(m, (e < 0 ? m->nenvs : e) + 1, 4);
+            if (e < 0) {
+                m->nenvs++;
+                m->envs = realloc(m->envs, sizeof(lenv*) * m->nenvs);
+                m->envs[m->nenvs - 1] = v->env;
+                limage_put(m, v->env->count, 4);
+                for (int i = 0; i < v->env->count; i++) {
+                    limage_write(m, v->env->vals[i]);
+                }
+            }
+            break;
+
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            limage_put(m, v->count, 4);
+            for (int i = 0; i < v->count; i++) {
+                limage_write(m, v->cell[i]);
+            }
+            break;
+
+        // Channels are stored empty
+        case LVAL_CHAN: limage_put(m, v->chan->mask + 1, 4); break;
+    }
+}
+
+unsigned long limage_get(limage_t* m, int bytes) {
+    if (m->bad || m->len - m->pos < (size_t)bytes) {
+        m->bad = 1;
+        return 0;
+    }
+    unsigned long x = 0;
+    for (int i = 0; i < bytes; i++) {
+        x |= (unsigned long)m->data[m->pos++] << (8 * i);
+    }
+    return x;
+}
+
+char* limage_get_str(limage_t* m) {
+    size_t n = limage_get(m, 4);
+    if (m->bad || m->len - m->pos < n) {
+        m->bad = 1;
+        return NULL;
+    }
+    char* s = malloc(n + 1);
+    memcpy(s, m->data + m->pos, n);
+    s[n] = '\0';
+    m->pos += n;
+    return s;
+}
+
+lval* limage_read(limage_t* m);
+
+lval* limage_read_lambda(limage_t* m) {
+    lval* v;
+    size_t c = limage_get(m, 4);
+    if (m->bad || c > (size_t)m->ncodes) {
+        m->bad = 1;
+        return NULL;
+    }
+
+    if (c < (size_t)m->ncodes) {
+        LREF_INC(m->codes[c]->refs);
+        v = lval_closure(m->codes[c], NULL, 0);
+    } else {
+        lval* formals = limage_read(m);
+        lval* body = formals ? limage_read(m) : NULL;
+        if (!body || formals->type != LVAL_QEXPR) {
+            if (formals) { lval_del(formals); }
+            if (body) { lval_del(body); }
+            m->bad = 1;
+            return NULL;
+        }
+        for (int i = 0; i < formals->count; i++) {
+            if (formals->cell[i]->type != LVAL_SYM) {
+                lval_del(formals);
+                lval_del(body);
+                m->bad = 1;
+                return NULL;
+            }
+            lsite_local(formals->cell[i]->sym);
+        }
+
+        v = lval_lambda(formals, body);
+        m->ncodes++;
+        m->codes = realloc(m->codes, sizeof(lcode*) * m->ncodes);
+        m->codes[m->ncodes - 1] = v->code;
+    }
+
+    size_t e = limage_get(m, 4);
+    if (m->bad || e > (size_t)m->nenvs + 1) {
+        m->bad = 1;
+    } else if (e > 0 && e <= (size_t)m->nenvs) {
+        v->env = lenv_ref(m->envs[e - 1]);
+        v->bound = v->env->count;
+    } else if (e > 0) {
+        size_t count = limage_get(m, 4);
+        if (count > (size_t)v->code->formals->count) {
+            m->bad = 1;
+        } else {
+            v->env = lenv_frame(v->code);
+            m->nenvs++;
+            m->envs = realloc(m->envs, sizeof(lenv*) * m->nenvs);
+            m->envs[m->nenvs - 1] = v->env;
+            for (size_t i = 0; i < count; i++) {
+                lval* x = limage_read(m);
+                if (!x) { break; }
+                v->env->vals[v->env->count++] = x;
+            }
+            v->bound = v->env->count;
+        }
+    }
+
+    if (m->bad) {
+        lval_del(v);
+        return NULL;
+    }
+    return v;
+}
+
+// Reads one value, or returns NULL and marks the image bad
+lval* limage_read(limage_t* m) {
+    int type = limage_get(m, 1);
+    if (m->bad) { return NULL; }
+
+    lval* v = NULL;
+    char* s;
+    switch (type) {
+        case LVAL_NUM:
+            v = lval_num((long)limage_get(m, 8));
+            break;
+
+        case LVAL_SYM:
+        case LVAL_STR:
+            s = limage_get_str(m);
+            if (!s) { break; }
+            v = type == LVAL_SYM ? lval_sym(s) : lval_str(s);
+            free(s);
+            break;
+
+        case LVAL_ERR: {
+            int code = limage_get(m, 4);
+            s = limage_get_str(m);
+            if (!s) { break; }
+            if (code < 0 || code >= LERR_COUNT) {
+                free(s);
+                break;
+            }
+            if (lerr_owned(code)) {
+                v = lval_err_owned(code, s);
+            } else {
+                // Static names are all names of builtins
+                lbuiltin_t* b = limage_builtin_name(s);
+                v = lval_err(code, b ? b->name : NULL, 0, 0);
+            }
+            free(s);
+            v->err_args[0] = (long)limage_get(m, 8);
+            v->err_args[1] = (long)limage_get(m, 8);
+            break;
+        }
+
+        case LVAL_SFUN:
+        case LVAL_FUN:
+            if (limage_get(m, 1)) {
+                v = type == LVAL_FUN ? limage_read_lambda(m) : NULL;
+                break;
+            }
+            s = limage_get_str(m);
+            lbuiltin_t* b = s ? limage_builtin_name(s) : NULL;
+            free(s);
+            s = b ? limage_get_str(m) : NULL;
+            if (!s) { break; }
+            v = type == LVAL_FUN ? lval_fun(b->func) : lval_sfun(b->func);
+            v->sym = s;
+            break;
+
+        case LVAL_QEXPR:
+        case LVAL_SEXPR: {
+            size_t count = limage_get(m, 4);
+            v = type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+            for (size_t i = 0; i < count && !m->bad; i++) {
+                lval* x = limage_read(m);
+                if (x) { v = lval_add(v, x); }
+            }
+            break;
+        }
+
+        case LVAL_CHAN: {
+            long size = limage_get(m, 4);
+            if (size > 0 && size <= LCHAN_MAX && (size & (size - 1)) == 0) {
+                v = lval_chan(size);
+            }
+            break;
+        }
+    }
+
+    if (!v || m->bad) {
+        if (v) { lval_del(v); }
+        m->bad = 1;
+        return NULL;
+    }
+    return v;
+}
+
+lval* builtin_save_image(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("save-image", a->count, 1));
+    LASSERT(a, a->cell[0]->type == LVAL_STR,
+            LTYPE_ERR("save-image", a->cell[0]->type, LVAL_STR));
+
+    while (e->par) {
+        e = e->par;
+    }
+
+    limage_t m = {{0}};
+    lbuf_puts(&m.out, LIMAGE_MAGIC);
+    limage_put(&m, LIMAGE_VERSION, 4);
+    limage_put(&m, e->count, 4);
+    for (int i = 0; i < e->count; i++) {
+        limage_put_str(&m, e->syms[i]);
+        limage_write(&m, e->vals[i]);
+    }
+    free(m.codes);
+    free(m.envs);
+
+    FILE* f = fopen(a->cell[0]->str, "wb");
+    if (!f) {
+        lval* err = lval_err_owned(LERR_FILE, a->cell[0]->str);
+        free(m.out.data);
+        lval_del(a);
+        return err;
+    }
+    fwrite(m.out.data, 1, m.out.len, f);
+    fclose(f);
+    free(m.out.data);
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+// Reads the whole image before defining anything, so a bad one changes
+// nothing
+lval* lval_load_image(lenv* e, char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) { return lval_err_owned(LERR_FILE, filename); }
+
+    limage_t m = {{0}};
+    lbuf data = {0};
+    lbuf_read(&data, f);
+    fclose(f);
+    m.data = (unsigned char*)data.data;
+    m.len = data.len;
+
+    size_t magic = strlen(LIMAGE_MAGIC);
+    if (m.len < magic || memcmp(m.data, LIMAGE_MAGIC, magic) != 0) { m.bad = 1; }
+    m.pos = magic;
+    if (limage_get(&m, 4) != LIMAGE_VERSION) { m.bad = 1; }
+
+    size_t count = limage_get(&m, 4);
+    lval* syms = lval_qexpr();
+    lval* vals = lval_qexpr();
+    for (size_t i = 0; i < count && !m.bad; i++) {
+        char* s = limage_get_str(&m);
+        lval* x = s ? limage_read(&m) : NULL;
+        if (x) {
+            syms = lval_add(syms, lval_sym(s));
+            vals = lval_add(vals, x);
+        }
+        free(s);
+    }
+
+    if (!m.bad) {
+        while (e->par) {
+            e = e->par;
+        }
+        for (int i = 0; i < syms->count; i++) {
+            lenv_put(e, syms->cell[i], vals->cell[i]);
+        }
+    }
+
+    lval_del(syms);
+    lval_del(vals);
+    free(m.codes);
+    free(m.envs);
+    free(data.data);
+    return m.bad ? lval_err_owned(LERR_IMAGE, filename) : lval_sexpr();
+}
+
+lval* builtin_load_image(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LARG_ERR("load-image", a->count, 1));
+    LASSERT(a, a->cell[0]->type == LVAL_STR,
+            LTYPE_ERR("load-image", a->cell[0]->type, LVAL_STR));
+    LASSERT(a, !lpool_worker, lval_err(LERR_WORKER, "load-image", 0, 0));
+
+    lval* x = lval_load_image(e, a->cell[0]->str);
+    lval_del(a);
+    return x;
+}
+
+// Flame graph tools read samples as folded stacks: the frames outermost
+// first joined by ';', then a space and the number of samples with that
+// stack. Names are looked up once per distinct stack, after sampling ends.
+void lsample_frame(lbuf* b, long frame) {
+    if (frame >= 0) {
+        lbuiltin_t* x = limage_builtin_func((lbuiltin)frame);
+        lbuf_puts(b, x ? x->name : "?");
+        return;
+    }
+    int src = (int)(-frame - 1);
+    if (!src) {
+        lbuf_puts(b, "fn ?");
+        return;
+    }
+    lbuf_puts(b, "fn ");
+    for (char* c = lsources[src].file; *c; c++) {
+        lbuf_putc(b, *c == ';' ? '_' : *c);
+    }
+    lbuf_printf(b, ":%d:%d", lsources[src].line, lsources[src].col);
+}
+
+int lsample_cmp(const void* a, const void* b) {
+    long* x = *(long**)a;
+    long* y = *(long**)b;
+    if (x[0] != y[0]) { return x[0] < y[0] ? -1 : 1; }
+    for (long i = 1; i <= x[0]; i++) {
+        if (x[i] != y[i]) { return x[i] < y[i] ? -1 : 1; }
+    }
+    return 0;
+}
+
+// Ends sampling, writing the folded stacks to the file at path if given,
+// or to this thread's output. Returns {samples N dropped D}.
+lval* lsample_stop(char* path) {
+    lsample_disarm();
+    FILE* f = path ? fopen(path, "w") : lout();
+    if (!f) {
+        lsample_free();
+        return lval_err_owned(LERR_FILE, path);
+    }
+
+    long n = 0;
+    for (long i = 0; i < lsample.used; i += lsample.buf[i] + 1) {
+        n++;
+    }
+    long** samples = malloc(sizeof(long*) * (n ? n : 1));
+    n = 0;
+    for (long i = 0; i < lsample.used; i += lsample.buf[i] + 1) {
+        samples[n++] = lsample.buf + i;
+    }
+    qsort(samples, n, sizeof(long*), lsample_cmp);
+
+    lbuf b = {0};
+    LLOCK(lsource_lock);
+    for (long i = 0; i < n;) {
+        long j = i + 1;
+        while (j < n && lsample_cmp(&samples[i], &samples[j]) == 0) { j++; }
+        if (samples[i][0] == 0) { lbuf_puts(&b, "[toplevel]"); }
+        for (long k = 1; k <= samples[i][0]; k++) {
+            if (k > 1) { lbuf_putc(&b, ';'); }
+            lsample_frame(&b, samples[i][k]);
+        }
+        lbuf_printf(&b, " %ld\n", j - i);
+        i = j;
+    }
+    LUNLOCK(lsource_lock);
+    lbuf_flush(&b, f);
+    if (path) { fclose(f); }
+
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_sym("samples"));
+    x = lval_add(x, lval_num(n));
+    x = lval_add(x, lval_sym("dropped"));
+    x = lval_add(x, lval_num(lsample.dropped));
+    free(samples);
+    lsample_free();
+    return x;
+}
+
+// Writes out the CLISP_SAMPLE samples, if there are any, at exit
+void lsample_exit(char* sample) {
+    if (!sample || !lsample.on) {
+        lsample_free();
+        return;
+    }
+    lval* x = lsample_stop(strcmp(sample, "-") == 0 ? NULL : sample);
+    if (x->type == LVAL_ERR)
+        lval_println(x);
+    lval_del(x);
+}
+
+// (sample-start) or (sample-start HZ)
+lval* builtin_sample_start(lenv* e, lval* a) {
+    LASSERT(a, a->count <= 1, LARG_ERR("sample-start", a->count, 1));
+    LASSERT(a, !lpool_worker, lval_err(LERR_WORKER, "sample-start", 0, 0));
+    int hz = LSAMPLE_HZ;
+    if (a->count == 1) {
+        LASSERT(a, a->cell[0]->type == LVAL_NUM,
+                LTYPE_ERR("sample-start", a->cell[0]->type, LVAL_NUM));
+        LASSERT(a, a->cell[0]->num > 0 && a->cell[0]->num <= 100000,
+                lval_err(LERR_NUM, NULL, 0, 0));
+        hz = (int)a->cell[0]->num;
+    }
+    lval_del(a);
+    if (!lsample_start(hz)) { return lval_err(LERR_UNSUPPORTED, "sample-start", 0, 0); }
+    return lval_sexpr();
+}
+
+// (sample-stop) or (sample-stop "out.folded")
+lval* builtin_sample_stop(lenv* e, lval* a) {
+    LASSERT(a, a->count <= 1, LARG_ERR("sample-stop", a->count, 1));
+    if (a->count == 1) {
+        LASSERT(a, a->cell[0]->type == LVAL_STR,
+                LTYPE_ERR("sample-stop", a->cell[0]->type, LVAL_STR));
+    }
+    lval* x = lsample_stop(a->count == 1 ? a->cell[0]->str : NULL);
+    lval_del(a);
+    return x;
+}
+
+lbuiltin_t lbuiltins[] = {
+    // List functions
+    LBUILTIN("list", builtin_list),
+    LBUILTIN("head", builtin_head),
+    LBUILTIN("tail", builtin_tail),
+    LBUILTIN("join", builtin_join),
+    LBUILTIN("eval", builtin_eval),
+    LBUILTIN("cons", builtin_cons),
+    LBUILTIN("len" , builtin_len ),
+    LBUILTIN("init", builtin_init),
+    LBUILTIN("map", builtin_map),
+    LBUILTIN("pmap", builtin_pmap),
+    LBUILTIN("filter", builtin_filter),
+    LBUILTIN("foldl", builtin_foldl),
+    LBUILTIN("foldr", builtin_foldr),
+
+    // Future functions
+    LBUILTIN("future", builtin_future),
+    LBUILTIN("await", builtin_await),
+    LBUILTIN("all", builtin_all),
+    LBUILTIN("any", builtin_any),
+    LBUILTIN("par", builtin_par),
+
+    // Channel functions
+    LSBUILTIN("chan", builtin_chan),
+    LBUILTIN("send", builtin_send),
+    LBUILTIN("recv", builtin_recv),
+    LBUILTIN("spawn", builtin_spawn),
+
+    // String functions
+    LBUILTIN("to-string", builtin_to_string),
+
+    // Mathematical functions
+    LBUILTIN("+", builtin_add),
+    LBUILTIN("-", builtin_sub),
+    LBUILTIN("*", builtin_mul),
+    LBUILTIN("/", builtin_div),
+
+    // Variable functions
+    LBUILTIN("def", builtin_def),
+    LBUILTIN("let", builtin_put),
+    LBUILTIN("fn", builtin_lambda),
+    LBUILTIN("fn-body", builtin_fn_body),
+
+    // Image functions
+    LBUILTIN("save-image", builtin_save_image),
+    LBUILTIN("load-image", builtin_load_image),
+
+    // Special functions (takes no arguments)
+    LSBUILTIN("print-env", builtin_print_env),
+    LSBUILTIN("server-stats", builtin_server_stats),
+    LSBUILTIN("gc-stats", builtin_gc_stats),
+    LSBUILTIN("profile-start", builtin_profile_start),
+    LSBUILTIN("profile-stop", builtin_profile_stop),
+    LSBUILTIN("sample-start", builtin_sample_start),
+    LSBUILTIN("sample-stop", builtin_sample_stop),
+    LSBUILTIN("exit", builtin_exit),
+
+    { NULL, NULL, NULL, 0 }
+};
+
+void lenv_add_builtins(lenv* e) {
+    for (int i = 0; lbuiltins[i].name; i++) {
+        if (lbuiltins[i].special) {
+            lenv_add_sbuiltin(e, lbuiltins[i].name, lbuiltins[i].func);
+        } else {
+            lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+        }
+    }
+}
+
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+    // A symbol being called is looked up in place once the arguments are
+    // evaluated, rather than copied out of the environment
+    if (v->count > 1 && v->cell[0]->type == LVAL_SYM) {
+        for (int i = 1; i < v->count; i++) {
+            v->cell[i] = lval_eval(e, v->cell[i]);
+        }
+
+        lval* f = lenv_lookup_call(e, v);
+        if (!f) {
+            lval* err = lval_err_unbound(v->cell[0]->sym);
+            lval_del(v);
+            return err;
+        }
+        for (int i = 1; i < v->count; i++) {
+            if (v->cell[i]->type == LVAL_ERR)
+                return lval_take(v, i);
+        }
+        if (f->type != LVAL_FUN && f->type != LVAL_SFUN) {
+            lval_del(v);
+            return lval_err(LERR_NOT_FUN, NULL, 0, 0);
+        }
+
+        lval_del(lval_pop(v, 0));
+        return lval_call(e, f, v);
+    }
+
+    // Evaluate children
+    for (int i = 0; i < v->count; i++) {
+        v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+
+    return lval_apply(e, v);
+}
+
+// Applies an S-Expression whose children are already evaluated
+lval* lval_apply(lenv* e, lval* v) {
+    // Error checking
+    for (int i = 0; i < v->count; i++) {
+        if (v->cell[i]->type == LVAL_ERR)
+            return lval_take(v, i);
+    }
+
+    // Empty expression
+    if (v->count == 0)
+        return v;
+    // Single expression
+    if (v->count == 1 && v->cell[0]->type != LVAL_SFUN)
+        return lval_take(v, 0);
+
+    lval* f = lval_pop(v, 0);
+    if (f->type != LVAL_FUN && f->type != LVAL_SFUN) {
+        lval_del(f);
+        lval_del(v);
+        return lval_err(LERR_NOT_FUN, NULL, 0, 0);
+    }
+
+    lval* result = lval_call(e, f, v);
+    lval_del(f);
+    return result;
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    if (v->type == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+    if (v->type == LVAL_SEXPR)
+        return lval_eval_sexpr(e, v);
+
+    return v;
+}
+
+// Input read a line at a time is scanned for brackets and strings as it
+// arrives, so a form left open is only parsed again once a line could have
+// closed it, or once the input pending has doubled since the last try so
+// that a syntax error inside it is still found early. Otherwise every line
+// would re-parse the form from its start, and reading one form would be
+// quadratic in its length.
+typedef struct {
+    int depth;
+    int in_str;
+    int escape;
+    size_t tried;
+} lscan;
+
+void lscan_reset(lscan* s) {
+    s->depth = 0;
+    s->in_str = 0;
+    s->escape = 0;
+    s->tried = 0;
+}
+
+// Returns 1 if the pending input, pending bytes of it after data, is worth
+// parsing again
+int lscan_feed(lscan* s, char* data, size_t len, size_t pending) {
+    int open = s->in_str || s->depth > 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (s->in_str) {
+            if (s->escape) { s->escape = 0; }
+            else if (c == '\\') { s->escape = 1; }
+            else if (c == '"') { s->in_str = 0; }
+        } else if (c == '"') {
+            s->in_str = 1;
+        } else if (c == '(' || c == '{') {
+            s->depth++;
+        } else if (c == ')' || c == '}') {
+            s->depth--;
+        }
+        if (!s->in_str && s->depth <= 0) { open = 0; }
+    }
+    if (open && pending < 2 * s->tried) { return 0; }
+    s->tried = pending;
+    return 1;
+}
+
+void lval_load(lenv* e, mpc_parser_t* p, char* filename, FILE* f) {
+    char buffer[4096];
+    mpc_result_t r;
+    int status = MPC_STREAM_MORE;
+    lscan scan;
+    lscan_reset(&scan);
+
+    mpc_stream_t* stream = mpc_stream_new(filename, p, (mpc_dtor_t)lval_del);
+
+    // Evaluate every top level form as soon as it has been read
+    while (status != MPC_STREAM_DONE) {
+        status = mpc_stream_next(stream, &r);
+
+        if (status == MPC_STREAM_FORM) {
+            lval* x = lval_eval(e, r.output);
+            if (x->type == LVAL_ERR)
+                lval_println(x);
+            lval_del(x);
+        }
+        if (status == MPC_STREAM_ERROR) {
+            mpc_err_print(r.error);
+            mpc_err_delete(r.error);
+            lscan_reset(&scan);
+        }
+        if (mpc_stream_pending(stream) == 0) { lscan_reset(&scan); }
+        while (status == MPC_STREAM_MORE) {
+            if (!fgets(buffer, sizeof(buffer), f)) {
+                mpc_stream_finish(stream);
+                break;
+            }
+            size_t n = strlen(buffer);
+            mpc_stream_feed(stream, buffer, n);
+            if (lscan_feed(&scan, buffer, n, mpc_stream_pending(stream))) { break; }
+        }
+    }
+
+    mpc_stream_delete(stream);
+}
+
+// Files loaded from disk keep their parsed forms in a cache file next to
+// them, FILE.clc, stored the same way as values in images. It is used only
+// while the hash of the source and the format versions match, so an edited
+// file or a new runtime just parses again and rewrites it.
+
+#define LCACHE_MAGIC "CLISPCLC"
+#define LCACHE_VERSION 1
+
+// FNV-1a
+unsigned long lcache_hash(char* data, size_t len) {
+    unsigned long h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+void lcache_header(limage_t* m, unsigned long hash) {
+    lbuf_puts(&m->out, LCACHE_MAGIC);
+    limage_put(m, LCACHE_VERSION, 4);
+    limage_put(m, LIMAGE_VERSION, 4);
+    limage_put(m, hash, 8);
+}
+
+// The cached forms for a source with this hash, or NULL if there are none
+lval* lcache_read(char* path, unsigned long hash) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { return NULL; }
+
+    lbuf data = {0};
+    lbuf_read(&data, f);
+    fclose(f);
+
+    // The header must match byte for byte
+    limage_t m = {{0}};
+    lcache_header(&m, hash);
+    int ok = data.len >= m.out.len && memcmp(data.data, m.out.data, m.out.len) == 0;
+
+    m.data = (unsigned char*)data.data;
+    m.len = data.len;
+    m.pos = m.out.len;
+    m.bad = !ok;
+
+    size_t count = limage_get(&m, 4);
+    lval* forms = lval_qexpr();
+    for (size_t i = 0; i < count && !m.bad; i++) {
+        lval* x = limage_read(&m);
+        if (x) { forms = lval_add(forms, x); }
+    }
+    if (m.pos != m.len) { m.bad = 1; }
+
+    free(m.out.data);
+    free(m.codes);
+    free(m.envs);
+    free(data.data);
+    if (m.bad) {
+        lval_del(forms);
+        return NULL;
+    }
+    return forms;
+}
+
+// Follows the text of a file through the forms read from it. Each '(' or
+// '{' outside a string opens the next list in the order the forms are
+// walked, which gives every (fn ...) list the place it starts at.
+typedef struct {
+    char* file;
+    char* text;
+    size_t len;
+    size_t pos;
+    int line;
+    size_t line_start;
+} lsource_walk_t;
+
+void lsource_mark(lsource_walk_t* w, lval* v) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+
+    while (w->pos < w->len) {
+        char c = w->text[w->pos++];
+        if (c == '(' || c == '{') { break; }
+        if (c == '\n') {
+            w->line++;
+            w->line_start = w->pos;
+        }
+        if (c != '"') { continue; }
+        while (w->pos < w->len && w->text[w->pos] != '"') {
+            if (w->text[w->pos] == '\\') { w->pos++; }
+            if (w->pos < w->len && w->text[w->pos] == '\n') {
+                w->line++;
+                w->line_start = w->pos + 1;
+            }
+            w->pos++;
+        }
+        w->pos++;
+    }
+
+    if (v->type == LVAL_SEXPR && v->count > 0 && v->cell[0]->type == LVAL_SYM
+        && strcmp(v->cell[0]->sym, "fn") == 0) {
+        v->src = lsource_add(w->file, w->line, (int)(w->pos - w->line_start));
+    }
+    for (int i = 0; i < v->count; i++) {
+        lsource_mark(w, v->cell[i]);
+    }
+}
+
+// Forms of loaded files that failed to parse or evaluated to an error, on
+// this thread. --batch reads it to report which files failed.
+LTHREAD int lload_errors = 0;
+
+// Whether loading a file writes its FILE.clc cache. --batch turns this off
+// so it leaves the directory it runs alone.
+int lcache_writes = 1;
+
+void lval_load_form(lenv* e, lval* x) {
+    x = lval_eval(e, x);
+    if (x->type == LVAL_ERR) {
+        lval_println(x);
+        lload_errors++;
+    }
+    lval_del(x);
+}
+
+// Loads a file from disk, through its cache when it is current. Returns 0
+// if the file couldn't be read.
+int lval_load_file(lenv* e, mpc_parser_t* p, char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) { return 0; }
+    lbuf source = {0};
+    lbuf_read(&source, f);
+    fclose(f);
+
+    unsigned long hash = lcache_hash(source.data, source.len);
+    char* path = malloc(strlen(filename) + 5);
+    strcpy(path, filename);
+    strcat(path, ".clc");
+
+    lsource_walk_t w = { filename, source.data, source.len, 0, 1, 0 };
+    lval* forms = lcache_read(path, hash);
+    if (forms) {
+        for (int i = 0; i < forms->count; i++) {
+            lsource_mark(&w, forms->cell[i]);
+            lval_load_form(e, forms->cell[i]);
+            forms->cell[i] = NULL;
+        }
+        forms->count = 0;
+        lval_del(forms);
+        free(source.data);
+        free(path);
+        return 1;
+    }
+
+    // Each form is written to the new cache before it is evaluated, which
+    // consumes it. Files that don't parse cleanly aren't cached.
+    limage_t m = {{0}};
+    lcache_header(&m, hash);
+    size_t count_at = m.out.len;
+    limage_put(&m, 0, 4);
+    int count = 0;
+    int failed = 0;
+
+    mpc_stream_t* stream = mpc_stream_new(filename, p, (mpc_dtor_t)lval_del);
+    mpc_stream_feed(stream, source.data, source.len);
+    mpc_stream_finish(stream);
+
+    mpc_result_t r;
+    int status;
+    while ((status = mpc_stream_next(stream, &r)) != MPC_STREAM_DONE) {
+        if (status == MPC_STREAM_FORM) {
+            limage_write(&m, r.output);
+            count++;
+            lsource_mark(&w, r.output);
+            lval_load_form(e, r.output);
+        }
+        if (status == MPC_STREAM_ERROR) {
+            mpc_err_print_to(r.error, lout());
+            mpc_err_delete(r.error);
+            lload_errors++;
+            failed = 1;
+        }
+    }
+    mpc_stream_delete(stream);
+
+    if (!failed && lcache_writes) {
+        for (int i = 0; i < 4; i++) {
+            m.out.data[count_at + i] = (count >> (8 * i)) & 0xFF;
+        }
+        FILE* c = fopen(path, "wb");
+        if (c) {
+            fwrite(m.out.data, 1, m.out.len, c);
+            fclose(c);
+        }
+    }
+
+    free(m.out.data);
+    free(m.codes);
+    free(m.envs);
+    free(source.data);
+    free(path);
+    return 1;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    LASSERT(a, a->count == 2, LARG_ERR("fn", a->count, 2));
-    LASSERT(a, a->cell[0]->type, LTYPE_ERR("fn", a->cell[0]->type, LVAL_QEXPR));
-    LASSERT(a, a->cell[1]->type, LTYPE_ERR("fn", a->cell[1]->type, LVAL_QEXPR));
+// Runtime support for compiled programs
 
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM, LTYPE_ERR("fn", a->cell[0]->cell[i]->type, LVAL_SYM));
+// Calls builtin f on arguments already evaluated, as lval_eval_sexpr would
+lval* lval_apply_builtin(lenv* e, lbuiltin f, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        if (a->cell[i]->type == LVAL_ERR)
+            return lval_take(a, i);
     }
+    return f(e, a);
+}
 
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
+lval* lval_set_native(lval* v, ljit_fn fn) {
+    if (v->type == LVAL_FUN && !v->builtin) { v->code->native = fn; }
+    return v;
+}
 
-    return lval_lambda(formals, body);
+// Ahead-of-time compilation to C. Each top level form becomes a C function
+// evaluating its arguments into temporaries, builtins are called directly,
+// and lambdas whose bodies the JIT could handle also get a native version
+// working on C longs. Builtins are only called directly when the program
+// can be seen never to rebind their names.
+
+typedef struct {
+    lenv* e;
+    int dynamic;
+    int nbound;
+    char** bound;
+    lbuf fns;
+    lbuf out;
+    int temps;
+    int nfns;
+    int failed;
+} laot_t;
+
+void laot_bind(laot_t* c, lval* names) {
+    for (int i = 0; i < names->count; i++) {
+        if (names->cell[i]->type != LVAL_SYM) {
+            c->dynamic = 1;
+            continue;
+        }
+        c->nbound++;
+        c->bound = realloc(c->bound, sizeof(char*) * c->nbound);
+        c->bound[c->nbound - 1] = names->cell[i]->sym;
+    }
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
-    v->sym = malloc(strlen(name) + 1);
-    strcpy(v->sym, name);
-    lenv_def(e, k, v);
-    lval_del(k);
-    lval_del(v);
+int laot_is_binder(lval* x) {
+    return x->type == LVAL_SYM && (strcmp(x->sym, "def") == 0 ||
+        strcmp(x->sym, "let") == 0 || strcmp(x->sym, "fn") == 0);
 }
 
-void lenv_add_sbuiltin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_sfun(func);
-    v->sym = malloc(strlen(name) + 1);
-    strcpy(v->sym, name);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+// Finds every name the program might bind, quoted code included. Binding
+// through a computed list, or passing a binder around, defeats this.
+void laot_scan(laot_t* c, lval* x) {
+    if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return; }
+
+    for (int i = 0; i < x->count; i++) {
+        if (i > 0 && laot_is_binder(x->cell[i])) { c->dynamic = 1; }
+        laot_scan(c, x->cell[i]);
+    }
+    if (x->count > 1 && laot_is_binder(x->cell[0])) {
+        if (x->cell[1]->type == LVAL_QEXPR) {
+            laot_bind(c, x->cell[1]);
+        } else {
+            c->dynamic = 1;
+        }
+    }
 }
 
-void lenv_add_builtins(lenv* e) {
-    // List functions
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "cons", builtin_cons);
-    lenv_add_builtin(e, "len" , builtin_len );
-    lenv_add_builtin(e, "init", builtin_init);
+lbuiltin_t* laot_builtin(laot_t* c, lval* x) {
+    if (c->dynamic || x->type != LVAL_SYM) { return NULL; }
+    for (int i = 0; i < c->nbound; i++) {
+        if (strcmp(c->bound[i], x->sym) == 0) { return NULL; }
+    }
+    for (int i = 0; lbuiltins[i].name; i++) {
+        if (strcmp(lbuiltins[i].name, x->sym) == 0) {
+            return lbuiltins[i].special ? NULL : &lbuiltins[i];
+        }
+    }
+    return NULL;
+}
 
-    // Mathematical functions
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+void laot_string(lbuf* b, char* s) {
+    lbuf_putc(b, '"');
+    for (; *s; s++) {
+        unsigned char ch = *s;
+        if (ch < ' ' || ch > '~') {
+            lbuf_printf(b, "\\%03o", ch);
+            continue;
+        }
+        if (ch == '"' || ch == '\\') { lbuf_putc(b, '\\'); }
+        lbuf_putc(b, ch);
+    }
+    lbuf_putc(b, '"');
+}
 
-    // Variable functions
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "let", builtin_put);
-    lenv_add_builtin(e, "fn", builtin_lambda);
+void laot_long(lbuf* b, long x) {
+    // The most negative long has no literal of its own
+    if (x < -9223372036854775807L) {
+        lbuf_puts(b, "(-9223372036854775807L - 1)");
+    } else {
+        lbuf_putl(b, x);
+        lbuf_putc(b, 'L');
+    }
+}
 
-    // Special functions (takes no arguments)
-    lenv_add_sbuiltin(e, "print-env", builtin_print_env);
-    lenv_add_sbuiltin(e, "exit", builtin_exit);
+// Emits a declaration of a new temporary, returning its number
+int laot_temp(laot_t* c) {
+    lbuf_printf(&c->out, "    lval* t%i = ", c->temps);
+    return c->temps++;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-    // Evaluate children
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+// Rebuilds x as data
+int laot_quote(laot_t* c, lval* x) {
+    int t;
+    switch (x->type) {
+        case LVAL_NUM:
+            t = laot_temp(c);
+            lbuf_puts(&c->out, "lval_num(");
+            laot_long(&c->out, x->num);
+            lbuf_puts(&c->out, ");\n");
+            return t;
+        case LVAL_SYM:
+            t = laot_temp(c);
+            lbuf_puts(&c->out, "lval_sym(");
+            laot_string(&c->out, x->sym);
+            lbuf_puts(&c->out, ");\n");
+            return t;
+        case LVAL_STR:
+            t = laot_temp(c);
+            lbuf_puts(&c->out, "lval_str(");
+            laot_string(&c->out, x->str);
+            lbuf_puts(&c->out, ");\n");
+            return t;
+        case LVAL_ERR:
+            // The reader gives errors for numbers out of range
+            t = laot_temp(c);
+            if (lerr_owned(x->err)) {
+                lbuf_printf(&c->out, "lval_err_owned(%i, ", x->err);
+                laot_string(&c->out, x->err_name);
+                lbuf_puts(&c->out, ");\n");
+                return t;
+            }
+            lbuf_printf(&c->out, "lval_err(%i, ", x->err);
+            if (x->err_name) {
+                laot_string(&c->out, x->err_name);
+            } else {
+                lbuf_puts(&c->out, "NULL");
+            }
+            lbuf_printf(&c->out, ", %liL, %liL);\n", x->err_args[0], x->err_args[1]);
+            return t;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            t = laot_temp(c);
+            lbuf_puts(&c->out, x->type == LVAL_QEXPR ? "lval_qexpr();\n" : "lval_sexpr();\n");
+            for (int i = 0; i < x->count; i++) {
+                int y = laot_quote(c, x->cell[i]);
+                lbuf_printf(&c->out, "    t%i = lval_add(t%i, t%i);\n", t, t, y);
+            }
+            return t;
+        default:
+            // Nothing else can be read from a program
+            c->failed = 1;
+            t = laot_temp(c);
+            lbuf_puts(&c->out, "NULL;\n");
+            return t;
     }
-    
-    // Error checking
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR)
-            return lval_take(v, i);
+}
+
+// Emits statements computing the value of the arithmetic expression x on
+// the formals into a long, returning its number, or -1 if x is anything else
+int laot_native_expr(laot_t* c, lbuf* b, int* temps, lval* formals, lval* x) {
+    if (x->type == LVAL_NUM) {
+        lbuf_printf(b, "    long n%i = ", *temps);
+        laot_long(b, x->num);
+        lbuf_puts(b, ";\n");
+        return (*temps)++;
+    }
+    if (x->type == LVAL_SYM) {
+        for (int i = 0; i < formals->count; i++) {
+            if (strcmp(formals->cell[i]->sym, x->sym) == 0) {
+                lbuf_printf(b, "    long n%i = x%i;\n", *temps, i);
+                return (*temps)++;
+            }
+        }
+        return -1;
     }
+    if (x->type != LVAL_SEXPR || x->count == 0) { return -1; }
+    if (x->count == 1) { return laot_native_expr(c, b, temps, formals, x->cell[0]); }
 
-    // Empty expression
-    if (v->count == 0)
-        return v;
-    // Single expression
-    if (v->count == 1 && v->cell[0]->type != LVAL_SFUN)
-        return lval_take(v, 0);
+    lbuiltin_t* f = laot_builtin(c, x->cell[0]);
+    if (!f || (f->func != builtin_add && f->func != builtin_sub &&
+               f->func != builtin_mul && f->func != builtin_div)) {
+        return -1;
+    }
+    char op = f->name[0];
 
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN && f->type != LVAL_SFUN) {
-        lval_del(f);
-        lval_del(v);
-        return lval_err("First element is not a function.");
+    int acc = laot_native_expr(c, b, temps, formals, x->cell[1]);
+    if (acc < 0) { return -1; }
+    if (x->count == 2 && op == '-') {
+        lbuf_printf(b, "    long n%i = -n%i;\n", *temps, acc);
+        acc = (*temps)++;
+    }
+    for (int i = 2; i < x->count; i++) {
+        int y = laot_native_expr(c, b, temps, formals, x->cell[i]);
+        if (y < 0) { return -1; }
+        if (op == '/') {
+            lbuf_printf(b, "    if (n%i == 0) { return 0; }\n", y);
+        }
+        lbuf_printf(b, "    long n%i = n%i %c n%i;\n", *temps, acc, op, y);
+        acc = (*temps)++;
     }
+    return acc;
+}
 
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+// A native version of (fn formals body), same contract as the JIT's
+int laot_native(laot_t* c, lval* formals, lval* body) {
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->type != LVAL_SYM) { return -1; }
+    }
+
+    lbuf b = {0};
+    int temps = 0;
+    lbuf_printf(&b, "static int clisp_fn_%i(lval** args, long* out) {\n", c->nfns);
+    for (int i = 0; i < formals->count; i++) {
+        lbuf_printf(&b, "    if (args[%i]->type != LVAL_NUM) { return 0; }\n", i);
+        lbuf_printf(&b, "    long x%i = args[%i]->num;\n", i, i);
+        lbuf_printf(&b, "    (void)x%i;\n", i);
+    }
+
+    // Compiled as the list it is evaluated as, leaving the program alone
+    lval list = *body;
+    list.type = LVAL_SEXPR;
+    int r = laot_native_expr(c, &b, &temps, formals, &list);
+    if (r < 0) {
+        free(b.data);
+        return -1;
+    }
+
+    lbuf_printf(&b, "    *out = n%i;\n    return 1;\n}\n\n", r);
+    lbuf_reserve(&c->fns, b.len);
+    memcpy(c->fns.data + c->fns.len, b.data, b.len);
+    c->fns.len += b.len;
+    free(b.data);
+    return c->nfns++;
 }
 
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+// Emits statements evaluating x, returning the temporary holding the result
+int laot_emit(laot_t* c, lval* x) {
+    int t;
+    switch (x->type) {
+        case LVAL_SYM:
+            t = laot_temp(c);
+            lbuf_puts(&c->out, "lval_eval(e, lval_sym(");
+            laot_string(&c->out, x->sym);
+            lbuf_puts(&c->out, "));\n");
+            return t;
+        case LVAL_SEXPR:
+            break;
+        default:
+            return laot_quote(c, x);
     }
-    if (v->type == LVAL_SEXPR)
-        return lval_eval_sexpr(e, v);
 
-    return v;
+    lbuiltin_t* f = x->count > 1 ? laot_builtin(c, x->cell[0]) : NULL;
+
+    int native = -1;
+    if (f && f->func == builtin_lambda && x->count == 3 &&
+        x->cell[1]->type == LVAL_QEXPR && x->cell[2]->type == LVAL_QEXPR) {
+        native = laot_native(c, x->cell[1], x->cell[2]);
+    }
+
+    int args[x->count];
+    for (int i = f ? 1 : 0; i < x->count; i++) {
+        args[i] = laot_emit(c, x->cell[i]);
+    }
+
+    int a = laot_temp(c);
+    lbuf_puts(&c->out, "lval_sexpr();\n");
+    for (int i = f ? 1 : 0; i < x->count; i++) {
+        lbuf_printf(&c->out, "    t%i = lval_add(t%i, t%i);\n", a, a, args[i]);
+    }
+
+    t = laot_temp(c);
+    if (!f) {
+        lbuf_printf(&c->out, "lval_apply(e, t%i);\n", a);
+    } else if (native < 0) {
+        lbuf_printf(&c->out, "lval_apply_builtin(e, %s, t%i);\n", f->cname, a);
+    } else {
+        lbuf_printf(&c->out, "lval_set_native(lval_apply_builtin(e, %s, t%i), clisp_fn_%i);\n",
+                    f->cname, a, native);
+    }
+    return t;
+}
+
+// Compiles the forms of a program, returning 0 on success
+int lval_compile(lval* prog, char* source, FILE* f) {
+    laot_t c = {0};
+    laot_scan(&c, prog);
+
+    lbuf forms = {0};
+    for (int i = 0; i < prog->count; i++) {
+        c.temps = 0;
+        lbuf_printf(&c.out, "static lval* clisp_form_%i(lenv* e) {\n", i);
+        int t = laot_emit(&c, prog->cell[i]);
+        lbuf_printf(&c.out, "    return t%i;\n}\n\n", t);
+        lbuf_printf(&forms, "        clisp_form_%i,\n", i);
+    }
+
+    fprintf(f,
+        "// Compiled by clisp --compile from %s. It includes the clisp runtime,\n"
+        "// so build it next to clisp.c and mpc.c with\n"
+        "//   gcc -O2 -o prog prog.c mpc.c -ledit -lm -pthread\n\n"
+        "#define main clisp_main\n"
+        "#include \"clisp.c\"\n"
+        "#undef main\n\n", source);
+    if (c.failed) {
+        printf("Error: %s holds a value that cannot be compiled.\n", source);
+        free(c.bound);
+        free(c.fns.data);
+        free(c.out.data);
+        free(forms.data);
+        return 1;
+    }
+    if (c.fns.len) { fwrite(c.fns.data, 1, c.fns.len, f); }
+    fwrite(c.out.data, 1, c.out.len, f);
+    fprintf(f,
+        "int main(int argc, char** argv) {\n"
+        "    lval* (*forms[])(lenv*) = {\n");
+    fwrite(forms.data, 1, forms.len, f);
+    fprintf(f,
+        "        NULL\n"
+        "    };\n\n"
+        "    lenv* env = lenv_new();\n"
+        "    lenv_add_builtins(env);\n"
+        "    ljit_enabled = getenv(\"CLISP_NOJIT\") == NULL;\n"
+        "    lreclaim_enabled = getenv(\"CLISP_NORECLAIM\") == NULL;\n\n"
+        "    // Like loading a file, only errors are printed\n"
+        "    for (int i = 0; forms[i]; i++) {\n"
+        "        lval* x = forms[i](env);\n"
+        "        if (x->type == LVAL_ERR)\n"
+        "            lval_println(x);\n"
+        "        lval_del(x);\n"
+        "    }\n\n"
+        "    lchan_cleanup();\n"
+        "    lsched_cleanup();\n"
+        "    lpool_cleanup();\n"
+        "    lenv_del(env);\n"
+        "    lreclaim_cleanup();\n"
+        "    lsite_cleanup();\n"
+        "    ljit_cleanup();\n"
+        "    lheap_cleanup();\n"
+        "    return 0;\n"
+        "}\n");
+
+    free(c.bound);
+    free(c.fns.data);
+    free(c.out.data);
+    free(forms.data);
+    return ferror(f) ? 1 : 0;
+}
+
+// A REPL session. Forms read from one line are evaluated together as a
+// single S-Expression, a form left open carries on to the next line.
+typedef struct {
+    lenv* env;
+    mpc_stream_t* stream;
+    lscan scan;
+    lval* line;
+} lsession;
+
+void lsession_init(lsession* s, lenv* env, mpc_parser_t* p, char* name) {
+    s->env = env;
+    s->stream = mpc_stream_new(name, p, (mpc_dtor_t)lval_del);
+    lscan_reset(&s->scan);
+    s->line = lval_sexpr();
+}
+
+void lsession_free(lsession* s) {
+    lval_del(s->line);
+    mpc_stream_delete(s->stream);
+}
+
+// Feeds one line of input, without its newline, writing what the REPL
+// prints for it to out. Returns 1 if the line finished a request.
+int lsession_feed(lsession* s, char* input, size_t len, lbuf* out) {
+    mpc_stream_feed(s->stream, input, len);
+    mpc_stream_feed(s->stream, "\n", 1);
+    if (!lscan_feed(&s->scan, input, len, mpc_stream_pending(s->stream))) { return 0; }
+
+    // Read every form completed so far
+    mpc_result_t r;
+    int status;
+    while ((status = mpc_stream_next(s->stream, &r)) == MPC_STREAM_FORM) {
+        s->line = lval_add(s->line, r.output);
+    }
+
+    if (status == MPC_STREAM_ERROR) {
+        char* msg = mpc_err_string(r.error);
+        lbuf_puts(out, msg);
+        free(msg);
+        mpc_err_delete(r.error);
+        lscan_reset(&s->scan);
+        lval_del(s->line);
+        s->line = lval_sexpr();
+        return 1;
+    }
+
+    if (mpc_stream_pending(s->stream) == 0) { lscan_reset(&s->scan); }
+    if (mpc_stream_pending(s->stream) == 0) {
+        lval* result = lval_eval(s->env, s->line);
+        lval_write(out, result);
+        lbuf_putc(out, '\n');
+        lval_del(result);
+        s->line = lval_sexpr();
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef CLISP_SERVER
+
+// clisp --serve PATH answers REPL sessions on a Unix domain socket, one per
+// connection, from a single epoll loop, until it gets SIGINT or SIGTERM.
+// Each session has its own environment under the global one, so let is
+// private to a session while def is shared. Requests are evaluated on the
+// loop's thread, so a slow one holds up the rest.
+
+// A reply still being written: when its line arrived, and where it ends in
+// the client's output buffer
+typedef struct {
+    long start;
+    size_t end;
+} lreply;
+
+typedef struct {
+    int fd;
+    int writing;
+    lsession s;
+    lbuf in;
+    lbuf out;
+    size_t sent;
+    lreply* replies;
+    int nreplies;
+} lclient;
+
+volatile sig_atomic_t lserve_stop = 0;
+
+void lserve_signal(int sig) {
+    lserve_stop = 1;
+}
+
+lclient* lclient_new(int fd, lenv* env, mpc_parser_t* p) {
+    lclient* c = calloc(1, sizeof(lclient));
+    c->fd = fd;
+    lenv* e = lenv_new();
+    e->par = env;
+    lsession_init(&c->s, e, p, "<socket>");
+    return c;
+}
+
+void lclient_del(int ep, lclient* c) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    lenv_del(c->s.env);
+    lsession_free(&c->s);
+    free(c->in.data);
+    free(c->out.data);
+    free(c->replies);
+    free(c);
+}
+
+// Writes as much pending output as the socket takes, watching for it to
+// take more if some is left. Returns 0 if the client has gone.
+int lclient_flush(int ep, lclient* c) {
+    while (c->sent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+        if (n < 0) { return 0; }
+        c->sent += n;
+    }
+
+    // A request is timed until the socket has taken the last byte of its reply
+    int done = 0;
+    while (done < c->nreplies && c->replies[done].end <= c->sent) {
+        lstats_add(&lserve_stats, lnow() - c->replies[done].start);
+        done++;
+    }
+    c->nreplies -= done;
+    memmove(c->replies, c->replies + done, sizeof(lreply) * c->nreplies);
+
+    if (c->sent == c->out.len) {
+        c->out.len = 0;
+        c->sent = 0;
+    }
+
+    int writing = c->out.len > 0;
+    if (writing != c->writing) {
+        struct epoll_event ev = { .events = EPOLLIN | (writing ? EPOLLOUT : 0), .data.ptr = c };
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+        c->writing = writing;
+    }
+    return 1;
+}
+
+// Reads what has arrived and runs every complete line. Returns 0 once the
+// client has closed its end.
+int lclient_read(lclient* c) {
+    char chunk[4096];
+    int open = 1;
+    while (1) {
+        ssize_t n = recv(c->fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+        if (n <= 0) {
+            open = 0;
+            break;
+        }
+        lbuf_reserve(&c->in, n);
+        memcpy(c->in.data + c->in.len, chunk, n);
+        c->in.len += n;
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i < c->in.len; i++) {
+        if (c->in.data[i] != '\n') { continue; }
+        long t = lnow();
+        if (lsession_feed(&c->s, c->in.data + start, i - start, &c->out)) {
+            c->replies = realloc(c->replies, sizeof(lreply) * (c->nreplies + 1));
+            c->replies[c->nreplies++] = (lreply){ t, c->out.len };
+        }
+        start = i + 1;
+    }
+    memmove(c->in.data, c->in.data + start, c->in.len - start);
+    c->in.len -= start;
+    return open;
+}
+
+int lserve(lenv* env, mpc_parser_t* p, char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Error: Socket path '%s' is too long.\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        printf("Error: Could not listen on '%s'.\n", path);
+        if (fd >= 0) { close(fd); }
+        return 1;
+    }
+
+    struct sigaction sa = { .sa_handler = lserve_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+
+    int nclients = 0;
+    lclient** clients = NULL;
+
+    struct epoll_event events[64];
+    while (!lserve_stop) {
+        int n = epoll_wait(ep, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            lclient* c = events[i].data.ptr;
+
+            // The listening socket
+            if (!c) {
+                int cfd;
+                while ((cfd = accept(fd, NULL, NULL)) >= 0) {
+                    fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+                    fcntl(cfd, F_SETFD, FD_CLOEXEC);
+                    c = lclient_new(cfd, env, p);
+                    struct epoll_event cev = { .events = EPOLLIN, .data.ptr = c };
+                    epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &cev);
+                    nclients++;
+                    clients = realloc(clients, sizeof(lclient*) * nclients);
+                    clients[nclients - 1] = c;
+                }
+                continue;
+            }
+
+            int open = 1;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                open = lclient_read(c);
+            }
+            if (!lclient_flush(ep, c) || (!open && c->out.len == 0)) {
+                for (int j = 0; j < nclients; j++) {
+                    if (clients[j] == c) { clients[j] = clients[--nclients]; }
+                }
+                lclient_del(ep, c);
+            }
+        }
+    }
+
+    for (int i = 0; i < nclients; i++) {
+        lclient_del(ep, clients[i]);
+    }
+    free(clients);
+    close(ep);
+    close(fd);
+    unlink(path);
+
+    fprintf(stderr, "%ld requests, mean %ldus, p50 %ldus, p99 %ldus, max %ldus\n",
+            lserve_stats.count, lserve_stats.count ? lserve_stats.total / lserve_stats.count : 0,
+            lstats_percentile(&lserve_stats, 50), lstats_percentile(&lserve_stats, 99),
+            lserve_stats.max);
+    return 0;
+}
+
+#else
+
+int lserve(lenv* env, mpc_parser_t* p, char* path) {
+    puts("Error: clisp --serve is not supported on this platform.");
+    return 1;
+}
+
+#endif
+
+#ifdef CLISP_THREADS
+
+// clisp --batch DIR runs every .lsp file in DIR on its own, each in a fresh
+// clone of the environment the image left, writing what running it alone
+// would print to FILE.out beside it. lthread_count threads, counting the
+// caller, take the next file as they finish one, biggest first so that a
+// large file doesn't start last. clisp exits with status 1 if any file
+// couldn't be run, failed to parse or had a form evaluate to an error.
+
+typedef struct {
+    lenv* prelude;
+    mpc_parser_t* p;
+    int count;
+    char** paths;
+    off_t* sizes;
+    int next;
+    int failed;
+} lbatch_t;
+
+lbatch_t lbatch_job;
+
+int lbatch_cmp(const void* a, const void* b) {
+    off_t x = lbatch_job.sizes[*(const int*)a];
+    off_t y = lbatch_job.sizes[*(const int*)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void lbatch_run(char* path) {
+    char* out = malloc(strlen(path) + 5);
+    strcpy(out, path);
+    strcat(out, ".out");
+
+    FILE* f = fopen(out, "w");
+    lenv* e = lenv_clone(lbatch_job.prelude);
+    lval_out = f;
+    lload_errors = 0;
+    if (!f || !lval_load_file(e, lbatch_job.p, path)) {
+        __atomic_add_fetch(&lbatch_job.failed, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "Error: Could not run file '%s'.\n", path);
+    } else if (lload_errors > 0) {
+        __atomic_add_fetch(&lbatch_job.failed, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "Error: File '%s' had %i error(s), see '%s'.\n", path, lload_errors, out);
+    }
+    lprof_free();
+    lsample_free();
+    lval_out = NULL;
+    lenv_del(e);
+    if (f) { fclose(f); }
+    free(out);
+}
+
+void* lbatch_thread(void* arg) {
+    while (1) {
+        int i = __atomic_fetch_add(&lbatch_job.next, 1, __ATOMIC_RELAXED);
+        if (i >= lbatch_job.count) { break; }
+        lbatch_run(lbatch_job.paths[i]);
+    }
+    if (arg) { lheap_cleanup(); }
+    return NULL;
+}
+
+// Returns the number of files that couldn't be run or had errors. Caches
+// are still read but not written.
+int lbatch(lenv* env, mpc_parser_t* p, char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        printf("Error: Could not open directory '%s'.\n", dir);
+        return 1;
+    }
+
+    char** paths = NULL;
+    int count = 0;
+    struct dirent* ent;
+    while ((ent = readdir(d))) {
+        size_t n = strlen(ent->d_name);
+        if (n < 5 || strcmp(ent->d_name + n - 4, ".lsp") != 0) { continue; }
+        paths = realloc(paths, sizeof(char*) * (count + 1));
+        paths[count] = malloc(strlen(dir) + n + 2);
+        sprintf(paths[count], "%s/%s", dir, ent->d_name);
+        count++;
+    }
+    closedir(d);
+
+    lbatch_job.sizes = malloc(sizeof(off_t) * count);
+    int* order = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        lbatch_job.sizes[i] = stat(paths[i], &st) == 0 ? st.st_size : 0;
+        order[i] = i;
+    }
+    qsort(order, count, sizeof(int), lbatch_cmp);
+
+    lbatch_job.prelude = env;
+    lbatch_job.p = p;
+    lbatch_job.count = count;
+    lbatch_job.paths = malloc(sizeof(char*) * count);
+    for (int i = 0; i < count; i++) {
+        lbatch_job.paths[i] = paths[order[i]];
+    }
+    lbatch_job.next = 0;
+    lbatch_job.failed = 0;
+    lcache_writes = 0;
+
+    int size = lthread_count();
+    if (size > count) { size = count; }
+    pthread_t* threads = malloc(sizeof(pthread_t) * size);
+    int started = 1;
+    for (; started < size; started++) {
+        if (pthread_create(&threads[started], NULL, lbatch_thread, (void*)1) != 0) { break; }
+    }
+    lbatch_thread(NULL);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    free(order);
+    free(threads);
+    free(lbatch_job.paths);
+    free(lbatch_job.sizes);
+    return lbatch_job.failed;
+}
+
+#else
+
+int lbatch(lenv* env, mpc_parser_t* p, char* dir) {
+    puts("Error: clisp --batch is not supported on this platform.");
+    return 1;
 }
 
-int main() {
+#endif
+
+int main(int argc, char** argv) {
     // Create some parsers
     mpc_parser_t* Number = mpc_new("number");
     mpc_parser_t* Symbol = mpc_new("symbol");
+    mpc_parser_t* String = mpc_new("string");
     mpc_parser_t* Sexpr = mpc_new("sexpr");
     mpc_parser_t* Qexpr = mpc_new("qexpr");
     mpc_parser_t* Expr = mpc_new("expr");
     mpc_parser_t* Clisp = mpc_new("clisp");
 
+    // Have each rule build its lval directly
+    mpca_value(Number, (mpca_value_t)lval_read_num, (mpc_dtor_t)lval_del);
+    mpca_value(Symbol, (mpca_value_t)lval_read_sym, (mpc_dtor_t)lval_del);
+    mpca_value(String, (mpca_value_t)lval_read_str, (mpc_dtor_t)lval_del);
+    mpca_value(Sexpr, (mpca_value_t)lval_read_sexpr, (mpc_dtor_t)lval_del);
+    mpca_value(Qexpr, (mpca_value_t)lval_read_qexpr, (mpc_dtor_t)lval_del);
+    mpca_value(Expr, (mpca_value_t)lval_read_expr, (mpc_dtor_t)lval_del);
+    mpca_value(Clisp, (mpca_value_t)lval_read_sexpr, (mpc_dtor_t)lval_del);
+
     // Define them with the following language
-    mpca_lang(MPCA_LANG_DEFAULT,
+    mpca_lang(MPCA_LANG_VALUES,
         "                                                    \
         number   : /-?[0-9]+/ ;                              \
         symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;        \
+        string   : /\"(\\\\.|[^\"])*\"/ ;                   \
         sexpr    : '(' <expr>* ')' ;                         \
         qexpr    : '{' <expr>* '}' ;                         \
-        expr     : <number> | <symbol> | <sexpr> | <qexpr> ; \
+        expr     : <number> | <symbol> | <string>            \
+                 | <sexpr> | <qexpr> ;                       \
         clisp    : /^/ <expr>* /$/ ;                         \
-        ", Number, Symbol, Sexpr, Qexpr, Expr, Clisp);
+        ", Number, Symbol, String, Sexpr, Qexpr, Expr, Clisp);
 
 
-    puts("Clisp version 0.0.0.1");
-    puts("Exit: Ctrl + C \n");
+    // clisp --compile prog.lsp -o prog.c
+    if (argc > 1 && strcmp(argv[1], "--compile") == 0) {
+        int status = 1;
+        mpc_result_t r;
+        if (argc != 5 || strcmp(argv[3], "-o") != 0) {
+            puts("Usage: clisp --compile prog.lsp -o prog.c");
+        } else if (!mpc_parse_contents(argv[2], Clisp, &r)) {
+            mpc_err_print(r.error);
+            mpc_err_delete(r.error);
+        } else {
+            FILE* f = fopen(argv[4], "w");
+            if (!f) {
+                printf("Error: Could not open file '%s'.\n", argv[4]);
+            } else {
+                status = lval_compile(r.output, argv[2], f);
+                fclose(f);
+            }
+            lval_del(r.output);
+        }
+        mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Clisp);
+        lheap_cleanup();
+        return status;
+    }
 
     lenv* env = lenv_new();
     lenv_add_builtins(env);
+    ljit_enabled = getenv("CLISP_NOJIT") == NULL;
+    lreclaim_enabled = getenv("CLISP_NORECLAIM") == NULL;
+
+    // CLISP_PROFILE=FILE profiles the whole run to FILE as CSV, or to stdout
+    // as a table if it is '-'
+    char* profile = getenv("CLISP_PROFILE");
+    if (profile) { lprof_start(); }
+
+    // CLISP_SAMPLE=FILE samples the whole run, writing folded stacks to
+    // FILE, or to stdout if it is '-'
+    char* sample = getenv("CLISP_SAMPLE");
+    if (sample && !lsample_start(LSAMPLE_HZ)) {
+        puts("Error: CLISP_SAMPLE is not supported on this platform.");
+    }
 
-    while (1) {
-        char *input = readline("clisp> ");
-
-        add_history(input);
+    // clisp --image prelude.img starts from a saved image
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "--image") == 0) {
+        lval* x = lval_load_image(env, argv[2]);
+        if (x->type == LVAL_ERR)
+            lval_println(x);
+        lval_del(x);
+        first = 3;
+    }
 
-        // Attempts to parse the user input
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Clisp, &r)) {
-            lval* result = lval_eval(env, lval_read(r.output));
-            lval_println(result);
-            lval_del(result);
+    // clisp --serve PATH, clisp --batch DIR, or run any files given on the
+    // command line, '-' being stdin
+    int status = 0;
+    if (argc > first + 1 && strcmp(argv[first], "--serve") == 0) {
+        lserve(env, Expr, argv[first + 1]);
+    } else if (argc > first + 1 && strcmp(argv[first], "--batch") == 0) {
+        status = lbatch(env, Expr, argv[first + 1]) != 0;
+    } else if (argc > first) {
+        for (int i = first; i < argc; i++) {
+            if (strcmp(argv[i], "-") == 0) {
+                lval_load(env, Expr, "<stdin>", stdin);
+                continue;
+            }
 
-            mpc_ast_delete(r.output);
-        } else {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            if (!lval_load_file(env, Expr, argv[i]))
+                printf("Error: Could not open file '%s'.\n", argv[i]);
         }
+    }
+
+    if (argc > first) {
+        lprof_exit(profile);
+        lsample_exit(sample);
+        lchan_cleanup();
+        lsched_cleanup();
+        lpool_cleanup();
+        lenv_del(env);
+        lreclaim_cleanup();
+        lsource_cleanup();
+        lsite_cleanup();
+        ljit_cleanup();
+        mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Clisp);
+        lheap_cleanup();
+        return status;
+    }
+
+    puts("Clisp version 0.0.0.1");
+    puts("Exit: Ctrl + C \n");
 
+    lsession repl;
+    lsession_init(&repl, env, Expr, "<stdin>");
+
+    while (1) {
+        char *input = readline(mpc_stream_pending(repl.stream) ? "  ...> " : "clisp> ");
+        if (!input)
+            break;
+
+        add_history(input);
+
+        lbuf out = {0};
+        lsession_feed(&repl, input, strlen(input), &out);
         free(input);
+        lbuf_flush(&out, stdout);
     }
 
+    lsession_free(&repl);
+
+    lprof_exit(profile);
+    lsample_exit(sample);
+
     // Free the environment
+    // Stop other threads before freeing anything they might use
+    lchan_cleanup();
+    lsched_cleanup();
+    lpool_cleanup();
     lenv_del(env);
+    lreclaim_cleanup();
+    lsource_cleanup();
+    lsite_cleanup();
+    ljit_cleanup();
     // Free all the parsers
-    mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Clisp);
+    mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Clisp);
+    lheap_cleanup();
     
     return 0;
 }
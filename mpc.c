@@ -51,6 +51,15 @@ static mpc_state_t mpc_state_new(void) {
 ** back we can simply start reading from the
 ** buffer instead of the input.
 **
+** The buffer is a ring of fixed size chunks so
+** appending a character and rewinding to a mark
+** are both constant time. Chunks that lie wholly
+** before the oldest mark (or the cursor when
+** nothing is marked) are released as the input
+** advances, so memory use is bounded by the
+** largest backtracking region rather than the
+** length of the stream.
+**
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
@@ -71,10 +80,28 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_CHUNK_SIZE = 4096,
+  MPC_INPUT_CHUNKS_MIN = 4
+};
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+typedef struct {
+  char **chunks;
+  int slots;
+  int first;
+  int num;
+  long start;
+  long end;
+  size_t max;
+  char *spare;
+  int eof;
+  int overflow;
+} mpc_ring_t;
+
 typedef struct {
 
   int type;
@@ -82,7 +109,7 @@ typedef struct {
   mpc_state_t state;
 
   char *string;
-  char *buffer;
+  mpc_ring_t ring;
   FILE *file;
 
   int suppress;
@@ -112,7 +139,6 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->string = malloc(strlen(string) + 1);
   strcpy(i->string, string);
-  i->buffer = NULL;
   i->file = NULL;
 
   i->suppress = 0;
@@ -142,7 +168,6 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
-  i->buffer = NULL;
   i->file = NULL;
 
   i->suppress = 0;
@@ -171,9 +196,19 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
-  i->buffer = NULL;
   i->file = pipe;
 
+  i->ring.chunks = NULL;
+  i->ring.slots = 0;
+  i->ring.first = 0;
+  i->ring.num = 0;
+  i->ring.start = 0;
+  i->ring.end = 0;
+  i->ring.max = 0;
+  i->ring.spare = NULL;
+  i->ring.eof = 0;
+  i->ring.overflow = 0;
+
   i->suppress = 0;
   i->backtrack = 1;
   i->marks_num = 0;
@@ -199,7 +234,6 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
 
   i->string = NULL;
-  i->buffer = NULL;
   i->file = file;
 
   i->suppress = 0;
@@ -216,12 +250,92 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   return i;
 }
 
+static char mpc_ring_at(mpc_ring_t *r, long pos) {
+  long off = pos - r->start;
+  return r->chunks[(r->first + off / MPC_INPUT_CHUNK_SIZE) % r->slots][off % MPC_INPUT_CHUNK_SIZE];
+}
+
+static void mpc_ring_push(mpc_ring_t *r, char c) {
+
+  int j;
+  long off = r->end - r->start;
+  char **chunks;
+
+  if (off / MPC_INPUT_CHUNK_SIZE == r->num) {
+
+    if (r->num == r->slots) {
+      chunks = malloc(sizeof(char*) * (r->slots ? r->slots * 2 : MPC_INPUT_CHUNKS_MIN));
+      for (j = 0; j < r->num; j++) {
+        chunks[j] = r->chunks[(r->first + j) % r->slots];
+      }
+      free(r->chunks);
+      r->chunks = chunks;
+      r->slots = r->slots ? r->slots * 2 : MPC_INPUT_CHUNKS_MIN;
+      r->first = 0;
+    }
+
+    r->chunks[(r->first + r->num) % r->slots] = r->spare ? r->spare : malloc(MPC_INPUT_CHUNK_SIZE);
+    r->spare = NULL;
+    r->num++;
+  }
+
+  r->chunks[(r->first + off / MPC_INPUT_CHUNK_SIZE) % r->slots][off % MPC_INPUT_CHUNK_SIZE] = c;
+  r->end++;
+}
+
+static int mpc_ring_fill(mpc_input_t *i, long pos) {
+
+  int c;
+  mpc_ring_t *r = &i->ring;
+
+  while (r->end <= pos) {
+    if (r->eof || r->overflow) { return 0; }
+    if (r->max && (size_t)(r->end - r->start) >= r->max) {
+      r->overflow = 1;
+      return 0;
+    }
+    c = getc(i->file);
+    if (c == EOF) {
+      r->eof = 1;
+      return 0;
+    }
+    mpc_ring_push(r, c);
+  }
+
+  return 1;
+}
+
+static void mpc_ring_release(mpc_input_t *i) {
+
+  mpc_ring_t *r = &i->ring;
+  long low = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+
+  while (r->num > 0 && r->start + MPC_INPUT_CHUNK_SIZE <= low) {
+    free(r->spare);
+    r->spare = r->chunks[r->first];
+    r->first = (r->first + 1) % r->slots;
+    r->num--;
+    r->start += MPC_INPUT_CHUNK_SIZE;
+  }
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  long j;
+
   free(i->filename);
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_PIPE) {
+    for (j = i->ring.end - 1; j >= i->state.pos && j >= i->ring.start; j--) {
+      ungetc(mpc_ring_at(&i->ring, j), i->file);
+    }
+    for (j = 0; j < i->ring.num; j++) {
+      free(i->ring.chunks[(i->ring.first + j) % i->ring.slots]);
+    }
+    free(i->ring.chunks);
+    free(i->ring.spare);
+  }
 
   free(i->marks);
   free(i->lasts);
@@ -313,14 +427,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
@@ -336,11 +445,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
   }
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
+    mpc_ring_release(i);
   }
 
 }
@@ -359,14 +464,6 @@ static void mpc_input_rewind(mpc_input_t *i) {
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
-
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
-}
-
 static char mpc_input_getc(mpc_input_t *i) {
 
   char c = '\0';
@@ -377,15 +474,8 @@ static char mpc_input_getc(mpc_input_t *i) {
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
 
-      if (!i->buffer) { c = getc(i->file); return c; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+      if (!mpc_ring_fill(i, i->state.pos)) { return c; }
+      return mpc_ring_at(&i->ring, i->state.pos);
 
     default: return c;
   }
@@ -407,21 +497,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
 
     case MPC_INPUT_PIPE:
 
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+      if (!mpc_ring_fill(i, i->state.pos)) { return '\0'; }
+      return mpc_ring_at(&i->ring, i->state.pos);
 
     default: return c;
   }
@@ -437,34 +514,22 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
     default: { break; }
   }
+  (void) c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
   i->state.col++;
 
+  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
+    mpc_ring_release(i);
+  }
+
   if (c == '\n') {
     i->state.col = 0;
     i->state.row++;
@@ -552,7 +617,7 @@ static int mpc_input_soi(mpc_input_t* i, char **o) {
 
 static int mpc_input_eoi(mpc_input_t* i, char **o) {
   *o = NULL;
-  if (i->state.term) {
+  if (i->state.term || (i->type == MPC_INPUT_PIPE && i->ring.overflow)) {
     return 0;
   } else if (mpc_input_terminated(i)) {
     i->state.term = 1;
@@ -936,7 +1001,7 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *table; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_parser_t *sep; } mpc_pdata_sepby1;
 
@@ -966,6 +1031,8 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  mpca_value_t value;
+  mpc_dtor_t value_dtor;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -1042,6 +1109,10 @@ enum {
   MPC_PARSE_STACK_MIN = 4
 };
 
+enum {
+  MPC_OR_TRIAL = 0xFF
+};
+
 #define MPC_SUCCESS(x) r->output = x; return 1
 #define MPC_FAILURE(x) r->error = x; return 0
 #define MPC_PRIMITIVE(x) \
@@ -1284,6 +1355,27 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
       if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
 
+      if (p->data.or.table) {
+        k = p->data.or.table[(unsigned char)mpc_input_peekc(i)];
+        if (k != MPC_OR_TRIAL) {
+          if (mpc_parse_run(i, p->data.or.xs[k], r, e, depth+1)) {
+            MPC_SUCCESS(r->output);
+          }
+          /* The skipped alternatives cannot start here, so they fail at once, */
+          /* but what they expect still belongs in the error the trial gives.  */
+          for (j = 0; j < p->data.or.n; j++) {
+            if (j == k) {
+              *e = mpc_err_merge(i, *e, r->error);
+            } else if (mpc_parse_run(i, p->data.or.xs[j], &results_stk[0], e, depth+1)) {
+              MPC_SUCCESS(results_stk[0].output);
+            } else {
+              *e = mpc_err_merge(i, *e, results_stk[0].error);
+            }
+          }
+          MPC_FAILURE(NULL);
+        }
+      }
+
       results = p->data.or.n > MPC_PARSE_STACK_MIN
         ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
         : results_stk;
@@ -1346,6 +1438,9 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
+  } else if (i->type == MPC_INPUT_PIPE && i->ring.overflow) {
+    mpc_err_delete_internal(i, mpc_err_merge(i, e, r->error));
+    r->error = mpc_err_export(i, mpc_err_fail(i, "Pipe buffer limit exceeded!"));
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
@@ -1384,6 +1479,15 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+int mpc_parse_pipe_max(const char *filename, FILE *pipe, size_t max, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  i->ring.max = max;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
   FILE *f = fopen(filename, "rb");
@@ -1400,6 +1504,163 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   return res;
 }
 
+/*
+** Streaming
+*/
+
+/*
+** A stream holds the unconsumed tail of some
+** input which arrives in pieces. Each call to
+** `mpc_stream_next` skips whitespace and then
+** parses a single value from the front of the
+** tail using the string input, so there is no
+** backtracking cost beyond a single form.
+**
+** A value is only known to be complete once
+** it is followed by something - otherwise a
+** symbol like `ab` could still become `abc`.
+** So a parse which runs right up to the end of
+** the tail (or fails there) reports that more
+** input is needed, unless the stream has been
+** finished or the value ended on whitespace.
+**
+** A parse error discards the tail only up to
+** the end of the line the error is on, so the
+** values after it are still read.
+*/
+
+struct mpc_stream_t {
+  char *filename;
+  mpc_parser_t *parser;
+  mpc_dtor_t destructor;
+  char *buffer;
+  size_t start;
+  size_t length;
+  size_t slots;
+  long row;
+  long col;
+  char last;
+  int finished;
+  int dirty;
+};
+
+mpc_stream_t *mpc_stream_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->filename = malloc(strlen(filename) + 1);
+  strcpy(s->filename, filename);
+  s->parser = p;
+  s->destructor = d;
+  s->slots = 256;
+  s->buffer = malloc(s->slots);
+  s->buffer[0] = '\0';
+  s->start = 0;
+  s->length = 0;
+  s->row = 0;
+  s->col = 0;
+  s->last = '\0';
+  s->finished = 0;
+  s->dirty = 1;
+  return s;
+}
+
+void mpc_stream_delete(mpc_stream_t *s) {
+  free(s->filename);
+  free(s->buffer);
+  free(s);
+}
+
+void mpc_stream_feed(mpc_stream_t *s, const char *data, size_t length) {
+
+  if (s->start > 0 && s->start >= s->length - s->start) {
+    memmove(s->buffer, s->buffer + s->start, s->length - s->start + 1);
+    s->length -= s->start;
+    s->start = 0;
+  }
+
+  if (s->length + length + 1 > s->slots) {
+    while (s->length + length + 1 > s->slots) { s->slots *= 2; }
+    s->buffer = realloc(s->buffer, s->slots);
+  }
+
+  memcpy(s->buffer + s->length, data, length);
+  s->length += length;
+  s->buffer[s->length] = '\0';
+  s->dirty = 1;
+}
+
+void mpc_stream_finish(mpc_stream_t *s) {
+  s->finished = 1;
+  s->dirty = 1;
+}
+
+size_t mpc_stream_pending(mpc_stream_t *s) {
+  return s->length - s->start;
+}
+
+static void mpc_stream_advance(mpc_stream_t *s, size_t n) {
+  size_t j;
+  for (j = 0; j < n; j++) {
+    s->last = s->buffer[s->start + j];
+    s->col++;
+    if (s->last == '\n') { s->col = 0; s->row++; }
+  }
+  s->start += n;
+}
+
+int mpc_stream_next(mpc_stream_t *s, mpc_result_t *r) {
+
+  int x;
+  size_t n = 0;
+  mpc_input_t *i;
+
+  while (s->start + n < s->length && isspace((unsigned char)s->buffer[s->start + n])) { n++; }
+  mpc_stream_advance(s, n);
+
+  if (s->start == s->length) {
+    return s->finished ? MPC_STREAM_DONE : MPC_STREAM_MORE;
+  }
+
+  if (!s->dirty) { return MPC_STREAM_MORE; }
+
+  i = mpc_input_new_nstring(s->filename, "", 0);
+  free(i->string);
+  i->string = s->buffer + s->start;
+  i->state.row = s->row;
+  i->state.col = s->col;
+  i->last = s->last;
+
+  x = mpc_parse_input(i, s->parser, r);
+  n = i->state.pos;
+  i->string = NULL;
+  mpc_input_delete(i);
+
+  if (x) {
+    if (s->start + n < s->length || s->finished
+    ||  (n > 0 && isspace((unsigned char)s->buffer[s->start + n - 1]))) {
+      mpc_stream_advance(s, n);
+      return MPC_STREAM_FORM;
+    }
+  } else {
+    if (s->finished || r->error->state.pos < (long)(s->length - s->start)) {
+      n = r->error->state.pos;
+      while (s->start + n < s->length && s->buffer[s->start + n] != '\n') { n++; }
+      if (s->start + n < s->length) { n++; }
+      mpc_stream_advance(s, n);
+      return MPC_STREAM_ERROR;
+    }
+    mpc_err_delete(r->error);
+    r->error = NULL;
+    s->dirty = 0;
+    return MPC_STREAM_MORE;
+  }
+
+  /* Value ran up to the end of the tail so it might still continue */
+  s->destructor(r->output);
+  r->output = NULL;
+  s->dirty = 0;
+  return MPC_STREAM_MORE;
+}
+
 /*
 ** Building a Parser
 */
@@ -1413,6 +1674,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.table);
 
 }
 
@@ -1585,6 +1847,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.table) {
+        p->data.or.table = malloc(256);
+        memcpy(p->data.or.table, a->data.or.table, 256);
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -3381,6 +3647,212 @@ mpc_parser_t *mpca_and(int n, ...) {
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
+/*
+** Values
+*/
+
+/*
+** With `MPCA_LANG_VALUES` a grammar builds the
+** user's values directly instead of an AST.
+**
+** Each fragment of a rule produces a list of
+** the values of the rules it references along
+** with the text of any literals and regexes it
+** matched. Sequences and repeats concatenate
+** these lists. A rule with a value constructor
+** set by `mpca_value` turns its list into one
+** value, while a rule without one passes its
+** list straight on to whatever references it.
+**
+** The grammar is compiled as usual and then
+** rewritten, swapping the AST folds for list
+** folds and dropping the tag and state nodes.
+*/
+
+typedef struct {
+  char *text;
+  int num;
+  mpc_val_t **vals;
+  mpc_dtor_t *dtors;
+} mpca_value_list_t;
+
+static mpca_value_list_t *mpca_value_list_new(void) {
+  mpca_value_list_t *l = malloc(sizeof(mpca_value_list_t));
+  l->text = NULL;
+  l->num = 0;
+  l->vals = NULL;
+  l->dtors = NULL;
+  return l;
+}
+
+static void mpca_value_list_free(mpca_value_list_t *l) {
+  free(l->text);
+  free(l->vals);
+  free(l->dtors);
+  free(l);
+}
+
+static void mpcaf_value_delete(mpc_val_t *x) {
+  int j;
+  mpca_value_list_t *l = x;
+  if (l == NULL) { return; }
+  for (j = 0; j < l->num; j++) { l->dtors[j](l->vals[j]); }
+  mpca_value_list_free(l);
+}
+
+static mpc_val_t *mpcaf_value_text(mpc_val_t *x) {
+  mpca_value_list_t *l = mpca_value_list_new();
+  l->text = x;
+  return l;
+}
+
+static mpc_val_t *mpcaf_value_fold(int n, mpc_val_t **xs) {
+
+  int j, k;
+  size_t a, b;
+  mpca_value_list_t *l = NULL, *m;
+
+  for (j = 0; j < n; j++) {
+
+    m = xs[j];
+    if (m == NULL) { continue; }
+    if (l == NULL) { l = m; continue; }
+
+    if (m->num) {
+      l->vals = realloc(l->vals, sizeof(mpc_val_t*) * (l->num + m->num));
+      l->dtors = realloc(l->dtors, sizeof(mpc_dtor_t) * (l->num + m->num));
+      for (k = 0; k < m->num; k++) {
+        l->vals[l->num + k] = m->vals[k];
+        l->dtors[l->num + k] = m->dtors[k];
+      }
+      l->num += m->num;
+    }
+
+    if (m->text && l->text) {
+      a = strlen(l->text); b = strlen(m->text);
+      l->text = realloc(l->text, a + b + 1);
+      memcpy(l->text + a, m->text, b + 1);
+    } else if (m->text) {
+      l->text = m->text;
+      m->text = NULL;
+    }
+
+    mpca_value_list_free(m);
+  }
+
+  return l;
+}
+
+static mpc_val_t *mpcaf_value_ref(mpc_val_t *x, void *d) {
+  mpc_parser_t *p = d;
+  mpca_value_list_t *l;
+  if (!p->value) { return x; }
+  l = mpca_value_list_new();
+  l->num = 1;
+  l->vals = malloc(sizeof(mpc_val_t*));
+  l->dtors = malloc(sizeof(mpc_dtor_t));
+  l->vals[0] = x;
+  l->dtors[0] = p->value_dtor;
+  return l;
+}
+
+static mpc_val_t *mpcaf_value_rule(mpc_val_t *x, void *d) {
+  mpc_parser_t *p = d;
+  mpca_value_list_t *l = x;
+  mpc_val_t *v;
+  if (l == NULL) { return p->value("", 0, NULL); }
+  v = p->value(l->text ? l->text : "", l->num, l->vals);
+  mpca_value_list_free(l);
+  return v;
+}
+
+static mpc_parser_t *mpca_value_convert(mpc_parser_t *p) {
+
+  int j;
+  mpc_parser_t *t;
+
+  if (p->retained) { return mpc_apply_to(p, mpcaf_value_ref, p); }
+
+  switch (p->type) {
+
+    case MPC_TYPE_APPLY:
+      if (p->data.apply.f == mpcf_str_ast) {
+        p->data.apply.f = mpcaf_value_text;
+        return p;
+      }
+      if (p->data.apply.f == (mpc_apply_t)mpc_ast_add_root) {
+        t = p->data.apply.x;
+        free(p->name); free(p);
+        return mpca_value_convert(t);
+      }
+      return p;
+
+    case MPC_TYPE_APPLY_TO:
+      if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+      ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+        t = p->data.apply_to.x;
+        free(p->name); free(p);
+        return mpca_value_convert(t);
+      }
+      return p;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.f == mpcf_state_ast) {
+        t = p->data.and.xs[1];
+        mpc_delete(p->data.and.xs[0]);
+        free(p->data.and.xs); free(p->data.and.dxs); free(p->name); free(p);
+        return mpca_value_convert(t);
+      }
+      if (p->data.and.f == mpcf_fold_ast) {
+        p->data.and.f = mpcaf_value_fold;
+        for (j = 0; j < p->data.and.n; j++) {
+          p->data.and.xs[j] = mpca_value_convert(p->data.and.xs[j]);
+        }
+        for (j = 0; j < p->data.and.n-1; j++) {
+          p->data.and.dxs[j] = mpcaf_value_delete;
+        }
+      }
+      return p;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f == mpcf_fold_ast) {
+        p->data.repeat.f = mpcaf_value_fold;
+        p->data.repeat.dx = mpcaf_value_delete;
+        p->data.repeat.x = mpca_value_convert(p->data.repeat.x);
+      }
+      return p;
+
+    case MPC_TYPE_NOT:
+      p->data.not.dx = mpcaf_value_delete;
+      p->data.not.x = mpca_value_convert(p->data.not.x);
+      return p;
+
+    case MPC_TYPE_MAYBE:
+      p->data.not.x = mpca_value_convert(p->data.not.x);
+      return p;
+
+    case MPC_TYPE_EXPECT:  p->data.expect.x = mpca_value_convert(p->data.expect.x); return p;
+    case MPC_TYPE_PREDICT: p->data.predict.x = mpca_value_convert(p->data.predict.x); return p;
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        p->data.or.xs[j] = mpca_value_convert(p->data.or.xs[j]);
+      }
+      return p;
+
+    default: return p;
+  }
+
+}
+
+mpc_parser_t *mpca_value(mpc_parser_t *p, mpca_value_t f, mpc_dtor_t d) {
+  p->value = f;
+  p->value_dtor = d;
+  return p;
+}
+
 /*
 ** Grammar Parser
 */
@@ -3708,6 +4180,11 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
   while(*stmts) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
+    if (st->flags & MPCA_LANG_VALUES) {
+      mpc_optimise(stmt->grammar);
+      stmt->grammar = mpca_value_convert(stmt->grammar);
+      if (left->value) { stmt->grammar = mpc_apply_to(stmt->grammar, mpcaf_value_rule, left); }
+    }
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
@@ -3948,6 +4425,180 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
 }
 
+/*
+** Predictive Dispatch
+**
+** The FIRST set of a parser is the set of
+** characters it can begin with, plus a flag
+** for whether it may succeed without consuming
+** anything. Parsers we know nothing about
+** (satisfy, undefined, anything deeper than
+** the recursion limit) are assumed to accept
+** every character and the empty input.
+**
+** For an `or` a table is then built mapping
+** each character to the single alternative
+** which can start with it. Characters that
+** several alternatives could start with, or
+** that a nullable alternative might accept,
+** fall back to trying each in order.
+**
+** The table is computed when the `or` is
+** optimised, so redefining a parser it refers
+** to afterwards requires optimising it again.
+*/
+
+enum {
+  MPC_FIRST_DEPTH_MAX = 32
+};
+
+typedef struct {
+  unsigned char set[32];
+  int nullable;
+} mpc_first_t;
+
+static void mpc_first_add(mpc_first_t *f, unsigned char c) { f->set[c / 8] |= 1 << (c % 8); }
+static int mpc_first_has(mpc_first_t *f, unsigned char c) { return f->set[c / 8] & (1 << (c % 8)); }
+
+static void mpc_first_all(mpc_first_t *f) {
+  memset(f->set, 0xFF, sizeof(f->set));
+  f->nullable = 1;
+}
+
+static void mpc_first_union(mpc_first_t *f, mpc_first_t *g) {
+  int j;
+  for (j = 0; j < 32; j++) { f->set[j] |= g->set[j]; }
+}
+
+static void mpc_first(mpc_parser_t *p, mpc_first_t *f, int depth) {
+
+  int j;
+  const char *c;
+  mpc_first_t g;
+
+  memset(f, 0, sizeof(mpc_first_t));
+
+  if (depth == MPC_FIRST_DEPTH_MAX) { mpc_first_all(f); return; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_NOT:
+      f->nullable = 1;
+      return;
+
+    case MPC_TYPE_FAIL: return;
+
+    case MPC_TYPE_SINGLE: mpc_first_add(f, p->data.single.x); return;
+
+    case MPC_TYPE_RANGE:
+      for (j = (unsigned char)p->data.range.x; j <= (unsigned char)p->data.range.y; j++) {
+        mpc_first_add(f, j);
+      }
+      return;
+
+    case MPC_TYPE_ONEOF:
+      for (c = p->data.string.x; *c; c++) { mpc_first_add(f, *c); }
+      return;
+
+    case MPC_TYPE_NONEOF:
+      for (j = 1; j < 256; j++) {
+        if (!strchr(p->data.string.x, j)) { mpc_first_add(f, j); }
+      }
+      return;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) { mpc_first_add(f, p->data.string.x[0]); }
+      else { f->nullable = 1; }
+      return;
+
+    case MPC_TYPE_APPLY:      mpc_first(p->data.apply.x, f, depth+1); return;
+    case MPC_TYPE_APPLY_TO:   mpc_first(p->data.apply_to.x, f, depth+1); return;
+    case MPC_TYPE_EXPECT:     mpc_first(p->data.expect.x, f, depth+1); return;
+    case MPC_TYPE_PREDICT:    mpc_first(p->data.predict.x, f, depth+1); return;
+    case MPC_TYPE_CHECK:      mpc_first(p->data.check.x, f, depth+1); return;
+    case MPC_TYPE_CHECK_WITH: mpc_first(p->data.check_with.x, f, depth+1); return;
+    case MPC_TYPE_SEPBY1:     mpc_first(p->data.sepby1.x, f, depth+1); return;
+
+    case MPC_TYPE_MAYBE:
+      mpc_first(p->data.not.x, f, depth+1);
+      f->nullable = 1;
+      return;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_first(p->data.repeat.x, f, depth+1);
+      if (p->type == MPC_TYPE_MANY) { f->nullable = 1; }
+      if (p->type == MPC_TYPE_COUNT && p->data.repeat.n == 0) { f->nullable = 1; }
+      return;
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        mpc_first(p->data.or.xs[j], &g, depth+1);
+        mpc_first_union(f, &g);
+        if (g.nullable) { f->nullable = 1; }
+      }
+      if (p->data.or.n == 0) { f->nullable = 1; }
+      return;
+
+    case MPC_TYPE_AND:
+      f->nullable = 1;
+      for (j = 0; j < p->data.and.n && f->nullable; j++) {
+        mpc_first(p->data.and.xs[j], &g, depth+1);
+        mpc_first_union(f, &g);
+        f->nullable = g.nullable;
+      }
+      return;
+
+    default:
+      mpc_first_all(f);
+      return;
+  }
+
+}
+
+static void mpc_optimise_or_table(mpc_parser_t *p) {
+
+  int j, c;
+  mpc_first_t f;
+
+  free(p->data.or.table);
+  p->data.or.table = NULL;
+
+  if (p->data.or.n < 2 || p->data.or.n >= MPC_OR_TRIAL - 1) { return; }
+
+  p->data.or.table = malloc(256);
+  memset(p->data.or.table, MPC_OR_TRIAL, 256);
+
+  for (j = 0; j < p->data.or.n; j++) {
+
+    mpc_first(p->data.or.xs[j], &f, 0);
+
+    if (f.nullable) {
+      memset(p->data.or.table, MPC_OR_TRIAL, 256);
+      break;
+    }
+
+    for (c = 1; c < 256; c++) {
+      if (!mpc_first_has(&f, c)) { continue; }
+      p->data.or.table[c] = p->data.or.table[c] == MPC_OR_TRIAL ? j : MPC_OR_TRIAL - 1;
+    }
+  }
+
+  /* Characters claimed by several alternatives need the ordered trial */
+  for (c = 0; c < 256; c++) {
+    if (p->data.or.table[c] == MPC_OR_TRIAL - 1) { p->data.or.table[c] = MPC_OR_TRIAL; }
+  }
+
+}
+
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
   int i, n, m;
@@ -3998,7 +4649,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.table); free(t->name); free(t);
       continue;
     }
 
@@ -4012,7 +4663,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.table); free(t->name); free(t);
       continue;
     }
 
@@ -4115,6 +4766,11 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
+    /* Build `or` dispatch table */
+    if (p->type == MPC_TYPE_OR) {
+      mpc_optimise_or_table(p);
+    }
+
     return;
 
   }
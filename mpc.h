@@ -69,6 +69,7 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_pipe_max(const char *filename, FILE *pipe, size_t max, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
 /*
@@ -85,6 +86,27 @@ typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 typedef int(*mpc_check_t)(mpc_val_t**);
 typedef int(*mpc_check_with_t)(mpc_val_t**,void*);
 
+/*
+** Streaming
+*/
+
+struct mpc_stream_t;
+typedef struct mpc_stream_t mpc_stream_t;
+
+enum {
+  MPC_STREAM_ERROR = 0,
+  MPC_STREAM_FORM  = 1,
+  MPC_STREAM_MORE  = 2,
+  MPC_STREAM_DONE  = 3
+};
+
+mpc_stream_t *mpc_stream_new(const char *filename, mpc_parser_t *p, mpc_dtor_t d);
+void mpc_stream_delete(mpc_stream_t *s);
+void mpc_stream_feed(mpc_stream_t *s, const char *data, size_t length);
+void mpc_stream_finish(mpc_stream_t *s);
+size_t mpc_stream_pending(mpc_stream_t *s);
+int mpc_stream_next(mpc_stream_t *s, mpc_result_t *r);
+
 /*
 ** Building a Parser
 */
@@ -355,9 +377,14 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_VALUES               = 4
 };
 
+typedef mpc_val_t*(*mpca_value_t)(const char*,int,mpc_val_t**);
+
+mpc_parser_t *mpca_value(mpc_parser_t *p, mpca_value_t f, mpc_dtor_t d);
+
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
 
 mpc_err_t *mpca_lang(int flags, const char *language, ...);
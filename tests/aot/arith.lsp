@@ -0,0 +1,11 @@
+(def {sq} (fn {x} {* x x}))
+(def {poly} (fn {x y} {+ (* 3 x x) (- y 7) (/ (* x y) 2)}))
+(def {a} (sq 12))
+(def {b} (poly 5 9))
+(def {c} (+ (sq 3) (poly -2 4) (/ 100 7)))
+(def {d} (- 8))
+(def {e} (/ 1 0))
+(def {f} (poly 1))
+(def {g} (f 3))
+(def {h} (sq 2 3))
+(print-env)
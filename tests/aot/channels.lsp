@@ -0,0 +1,30 @@
+(def {shift} (fn {l n} {join l (map (fn {x} {+ x n}) l)}))
+(def {grow} (fn {l} {shift l (len l)}))
+(def {sq} (fn {x} {* x x}))
+(def {xs} (grow (grow (grow (grow (grow (grow {0})))))))
+(def {half} (grow (grow (grow (grow (grow {0}))))))
+(def {ch} (chan))
+(def {a} (list (send ch 1) (send ch {2 3}) (send ch "four") (recv ch) (recv ch) (recv ch)))
+(def {small} (chan 2))
+(def {p} (spawn {map (fn {x} {send small x}) {1 2 3 4 5 6 7 8}}))
+(def {b} (map (fn {i} {recv small}) {1 2 3 4 5 6 7 8}))
+(def {c} (len (await p)))
+(def {work} (chan 4))
+(def {out} (chan 4))
+(def {w0} (spawn {map (fn {i} {send out (sq (recv work))}) half}))
+(def {w1} (spawn {map (fn {i} {send out (sq (recv work))}) half}))
+(def {feeder} (spawn {map (fn {x} {send work x}) xs}))
+(def {d} (foldl + 0 (map (fn {i} {recv out}) xs)))
+(def {e} (list (len (await w0)) (len (await w1)) (len (await feeder))))
+(def {f} (recv 5))
+(def {g} (send ch))
+(def {xs} 0)
+(def {half} 0)
+(def {small} 0)
+(def {p} 0)
+(def {work} 0)
+(def {out} 0)
+(def {w0} 0)
+(def {w1} 0)
+(def {feeder} 0)
+(print-env)
@@ -0,0 +1,8 @@
+(def {xs} {1 99999999999999999999 3})
+(def {a} (len xs))
+(def {b} (+ 1 99999999999999999999))
+(def {c} (head (tail xs)))
+(def {d} (eval (list + 1 (head (tail xs)))))
+(def {e} 99999999999999999999)
+(def {f} (- 99999999999999999))
+(print-env)
@@ -0,0 +1,14 @@
+(def {f} (fn {x} {* x (+ 1 2)}))
+(def {a} (f 5))
+(def {+} (fn {x y} {- x y}))
+(def {b} (f 5))
+(def {g} (fn {x} {* x (len {1 2 3})}))
+(def {c} (g 2))
+(def {h} (fn {len} {g 2}))
+(def {d} (h 0))
+(def {k} (fn {x} {* x (- 10 4)}))
+(def {e} (map k {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39 40 41 42}))
+(def {-} (fn {x y} {* x y}))
+(def {e2} (map k {1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20 21 22 23 24 25 26 27 28 29 30 31 32 33 34 35 36 37 38 39 40 41 42}))
+(def {fb} (fn-body f))
+(print-env)
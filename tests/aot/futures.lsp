@@ -0,0 +1,23 @@
+(def {sq} (fn {x} {* x x}))
+(def {f1} (future {sq 7}))
+(def {a} (await f1))
+(def {b} (all (map (fn {x} {future {sq x}}) {1 2 3 4})))
+(def {c} (pmap sq {5 6 7 8}))
+(def {ch} (chan))
+(def {p} (spawn {send ch (sq 9)}))
+(def {d} (recv ch))
+(def {sq} (fn {x} {+ x 1000}))
+(def {e} (await (future {sq 2})))
+(def {f} (all (future {/ 1 0}) f1))
+(def {g} (any (future {sq 3}) (future {sq 3})))
+(def {h} (any (list f1 f1)))
+(def {i} (list (await f1) (await f1)))
+(def {j} (await (future {await (future {sq 4})})))
+(def {mk} (fn {k} {future {+ k 1}}))
+(def {k} (await (mk 41)))
+(def {l} (await 5))
+(def {n} (all (map (fn {x} {future {pmap sq (list x x)}}) {1 2 3})))
+(def {f1} 0)
+(def {ch} 0)
+(def {p} 0)
+(print-env)
@@ -0,0 +1,25 @@
+(def {shift} (fn {l n} {join l (map (fn {x} {+ x n}) l)}))
+(def {grow} (fn {l} {shift l (len l)}))
+(def {pair} (fn {l} {join (tail (init l)) (tail l)}))
+(def {drop} (fn {l} {init (init l)}))
+(def {value} (fn {p} {eval (tail p)}))
+(def {xs} (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow {0})))))))))))))
+(def {ys} (map (fn {x} {* x 2}) xs))
+(def {xs} 0)
+(def {ys} 0)
+(def {s} (gc-stats))
+(def {p99} (pair s))
+(def {p50} (pair (drop s)))
+(def {max} (pair (drop (drop s))))
+(def {mean} (pair (drop (drop (drop s)))))
+(def {pauses} (pair (drop (drop (drop (drop s))))))
+(def {keys} (join (head pauses) (head mean) (head max) (head p50) (head p99)))
+(def {counted} (/ (value pauses) (value pauses)))
+(def {ordered} (list (/ (value p50) (+ (value p99) 1)) (/ (value p99) (+ (value max) 1)) (/ (value mean) (+ (value max) 1))))
+(def {s} 0)
+(def {p99} 0)
+(def {p50} 0)
+(def {max} 0)
+(def {mean} 0)
+(def {pauses} 0)
+(print-env)
@@ -0,0 +1,16 @@
+(def {shift} (fn {l n} {join l (map (fn {x} {+ x n}) l)}))
+(def {grow} (fn {l} {shift l (len l)}))
+(def {sum} (fn {l} {foldl + 0 l}))
+(def {xs} (grow (grow (grow (grow (grow (grow (grow (grow {0})))))))))
+(def {fs} (map (fn {k} {future {map (fn {x} {+ x k}) xs}}) {0 1 2 3 4 5 6 7}))
+(def {a} (map sum (all fs)))
+(def {b} (map sum (pmap (fn {k} {map (fn {x} {* x k}) xs}) {1 2 3 4})))
+(def {ch} (chan 4))
+(def {p} (spawn {map (fn {k} {send ch (map (fn {x} {- x k}) xs)}) {1 2 3 4 5 6}}))
+(def {c} (map (fn {k} {sum (recv ch)}) {1 2 3 4 5 6}))
+(def {d} (len (await p)))
+(def {xs} 0)
+(def {fs} 0)
+(def {ch} 0)
+(def {p} 0)
+(print-env)
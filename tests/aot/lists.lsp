@@ -0,0 +1,13 @@
+(def {xs} {1 2 3 4 5 6 7 8 9 10})
+(def {double} (fn {x} {* 2 x}))
+(def {even} (fn {x} {- 1 (- x (* 2 (/ x 2)))}))
+(def {a} (map double xs))
+(def {b} (filter even xs))
+(def {c} (foldl + 0 xs))
+(def {d} (foldr (fn {x acc} {cons x acc}) {} xs))
+(def {e} (join (head xs) (tail (tail xs)) {x y}))
+(def {f} (list (len xs) (init {1 2 3}) (cons 0 {1})))
+(def {g} (eval {+ 1 2}))
+(def {h} (head {}))
+(def {s} (to-string (list 1 "two" {3})))
+(print-env)
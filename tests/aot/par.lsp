@@ -0,0 +1,15 @@
+(def {shift} (fn {l n} {join l (map (fn {x} {+ x n}) l)}))
+(def {grow} (fn {l} {shift l (len l)}))
+(def {sum} (fn {l} {foldl + 0 l}))
+(def {xs} (grow (grow (grow (grow (grow (grow (grow (grow {0})))))))))
+(def {a} (par {list (sum xs) (sum (map (fn {x} {* x 2}) xs)) (sum (map (fn {x} {* x 3}) xs))}))
+(def {b} (par {- (sum xs) (sum (map (fn {x} {+ x 1}) xs))}))
+(def {c} (par {+ 1 2 3}))
+(def {d} (par {list (sum xs) (sum (tail xs)) 7}))
+(def {e} (par {list (sum xs) (/ (sum xs) 0) (sum {x})}))
+(def {f} (par {list (sum xs) (def {y} 1)}))
+(def {g} (par {list (sum xs) (sum (map (fn {x} {def {z} x}) xs))}))
+(def {h} (par 5))
+(def {k} ((fn {n} {par {list (sum (map (fn {x} {+ x n}) xs)) (sum (map (fn {x} {- x n}) xs))}}) 1))
+(def {xs} 0)
+(print-env)
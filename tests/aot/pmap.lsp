@@ -0,0 +1,16 @@
+(def {shift} (fn {l n} {join l (map (fn {x} {+ x n}) l)}))
+(def {grow} (fn {l} {shift l (len l)}))
+(def {sq} (fn {x} {* x x}))
+(def {sum} (fn {l} {foldl (fn {acc y} {- y acc}) 0 l}))
+(def {xs} (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow {0}))))))))))))
+(def {n} (len (pmap sq xs)))
+(def {ok} (- (sum (pmap sq xs)) (sum (map sq xs))))
+(def {a} (pmap sq {1 2 3 4 5 6 7 8 9 10 11 12}))
+(def {b} (pmap sq {}))
+(def {c} (pmap (fn {x} {pmap sq x}) {{1 2} {3 4} {5 6}}))
+(def {d} (pmap (fn {x} {/ 12 x}) {1 2 0 3 {4}}))
+(def {e} (pmap (fn {x} {/ 12 x}) {1 2 {4} 3 0}))
+(def {f} (pmap (fn {x} {def {y} x}) {1 2}))
+(def {g} (pmap (fn {x} {+ x n}) {1 2 3}))
+(def {xs} 0)
+(print-env)
@@ -0,0 +1,13 @@
+(def {add} (fn {a b} {+ a b}))
+(def {k} (fn {z} {add 2 4}))
+(def {add} (fn {a b} {* a b 100}))
+(def {a} (k 0))
+(def {g} (fn {z} {* y 5}))
+(def {h} (fn {y} {g 0}))
+(def {b} (h 100))
+(def {+} (fn {x y} {- x y}))
+(def {d} (+ 10 3))
+(def {e} (foldl + 0 {1 2 3}))
+(def {f} (fn {x} {* x (+ 1 2)}))
+(def {g2} (f 5))
+(print-env)
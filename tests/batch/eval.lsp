@@ -0,0 +1,4 @@
+(def {a} 1)
+(def {b} (/ a 0))
+(def {c} (+ a 2))
+(print-env)
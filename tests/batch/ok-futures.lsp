@@ -0,0 +1,4 @@
+(def {f} (future {+ 1 2}))
+(def {a} (await f))
+(def {f} 0)
+(print-env)
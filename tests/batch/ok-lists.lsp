@@ -0,0 +1,4 @@
+(def {sq} (fn {x} {* x x}))
+(def {a} (map sq {1 2 3 4}))
+(def {b} (pmap sq {5 6 7 8}))
+(print-env)
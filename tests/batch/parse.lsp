@@ -0,0 +1,4 @@
+(def {a} 1)
+(def {b} (+ 1 ]
+(def {c} 3)
+(print-env)
@@ -0,0 +1,7 @@
+(def {a} 1)
+(def {b} (+ 1 ]
+(def {c} 4)
+(def {d} (+ 1
+  ] 2))
+(def {e} 5)
+(print-env)
@@ -0,0 +1,5 @@
+(def {sq} (fn {x} {* x x}))
+(def {sum} (fn {l} {foldl + 0 l}))
+(def {norm} (fn {l} {sum (map sq l)}))
+(def {a} (norm {1 2 3 4}))
+(def {c} (map (fn {x} {+ x 1}) {1 2}))
@@ -0,0 +1,12 @@
+(def {shift} (fn {l n} {join l (map (fn {x} {+ x n}) l)}))
+(def {grow} (fn {l} {shift l (len l)}))
+(def {sq} (fn {x} {* x x}))
+(def {s} (sample-start 2000))
+(def {xs} (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow (grow {0})))))))))))))))
+(def {a} (foldl + 0 (map sq xs)))
+(def {r} (sample-stop "work.folded"))
+(def {keys} (join (head r) (tail (init r))))
+(def {sampled} (/ (eval (tail (init (init r)))) (eval (tail (init (init r))))))
+(def {xs} 0)
+(def {r} 0)
+(print-env)
@@ -0,0 +1,39 @@
+// Sends stdin to a clisp --serve socket and copies every reply to stdout
+// until the server closes the connection
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main(int argc, char** argv) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (argc != 2 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "usage: client SOCKET\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    for (int tries = 0; connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0; tries++) {
+        if (tries == 50) {
+            fprintf(stderr, "client: could not connect to '%s'\n", argv[1]);
+            return 1;
+        }
+        usleep(100000);
+    }
+
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+        if (write(fd, buf, n) != (ssize_t)n) { return 1; }
+    }
+    shutdown(fd, SHUT_WR);
+
+    ssize_t got;
+    while ((got = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, got, stdout);
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,8 @@
+(def {shared} 10)
+(let {mine} 20)
+(+ shared mine)
+(list 1
+  2 3)
+(+ 1 ]
+(len (server-stats))
+(head (server-stats))
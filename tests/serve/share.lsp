@@ -0,0 +1,4 @@
+shared
+mine
+(def {shared} (+ shared 1))
+shared